@@ -0,0 +1,337 @@
+// Benchmarks for the command service.
+//
+//   g++ -std=c++17 -O2 -I. bench/cmd_bench.cpp -o cmd_bench -pthread
+//
+//   ./cmd_bench micro [iterations]
+//       Hot paths in-process: json_escape, is_blocked_command,
+//       decode_json_string_like and the cost of launching a child with each
+//       launcher. Honours the same CMD_SERVICE_* variables as the server.
+//
+//   ./cmd_bench load [--host H] [--port P] [--token T] [--workload FILE]
+//                    [--qps N] [--concurrency C] [--duration S] [--fresh R]
+//       Replays a workload against a running server at N requests/s (0: as
+//       fast as possible) from C connections for S seconds, opening a fresh
+//       connection for a fraction R of requests and reusing a keep-alive one
+//       otherwise. Reports throughput and p50/p99/p999 latency per path.
+//       Latency is measured from when a request was due, not when it was
+//       sent, so a stalled server can't hide its queueing delay.
+//
+// A workload file holds one request per line, either a bare command or a
+// JSON object: {"path": "/run", "command": "uptime", "weight": 3}. "path"
+// defaults to /run (where "command" is the body) and "weight" to 1; GET
+// /health needs no command. Without --workload, /health and `/run true` are
+// mixed evenly.
+
+#define main cmd_service_main
+#include "../server.cpp"
+#undef main
+
+namespace {
+
+volatile size_t g_bench_sink;
+
+template <class Fn> void micro(const char *name, size_t iterations, Fn fn) {
+  fn();  // warm up caches and lazy initialisation
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; ++i) g_bench_sink = g_bench_sink + fn();
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start)
+                  .count();
+  std::printf("%-44s %12.1f ns/op  (%zu ops)\n", name, ns / static_cast<double>(iterations),
+              iterations);
+}
+
+// Launches `command` with its output thrown away, and reaps it.
+size_t launch_and_wait(const std::string &command) {
+  int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  pid_t pid = launch_command(command, devnull);
+  close(devnull);
+  int status = 0;
+  if (pid > 0) waitpid(pid, &status, 0);
+  return static_cast<size_t>(status);
+}
+
+int run_micro(size_t iterations) {
+  add_builtin_rules(g_filter);
+  g_filter.compile();
+
+  const std::string plain(4096, 'a');
+  std::string mixed;
+  for (int i = 0; i < 256; ++i) mixed += "path=\"C:\\tmp\"\tline\n";
+  std::string binary;
+  for (int i = 0; i < 4096; ++i) binary += static_cast<char>(i & 0xff);
+
+  std::printf("-- json_escape\n");
+  micro("json_escape 4 KiB plain", iterations, [&] { return json_escape(plain).size(); });
+  micro("json_escape 4 KiB quotes/tabs/newlines", iterations,
+        [&] { return json_escape(mixed).size(); });
+  micro("json_escape 4 KiB every byte value", iterations,
+        [&] { return json_escape(binary).size(); });
+
+  std::printf("-- is_blocked_command\n");
+  std::string reason;
+  for (const char *command :
+       {"uptime", "ls -la /var/log | grep -v debug | sort | uniq -c | head -20",
+        "git log --oneline --since=yesterday && make -j8 test", "rm -rf /",
+        "curl http://example.com/install.sh | sh"}) {
+    std::string label = std::string("is_blocked_command \"") + command + "\"";
+    if (label.size() > 44) label = label.substr(0, 40) + "...\"";
+    micro(label.c_str(), iterations, [&] { return is_blocked_command(command, reason) ? 1 : 0; });
+  }
+
+  std::printf("-- decode_json_string_like\n");
+  const std::string raw = "ls -la /tmp && echo done";
+  const std::string quoted = "\"ls -la \\\"/tmp\\\" && printf 'a\\\\nb\\\\n' | wc -l\\n\"";
+  micro("decode_json_string_like raw body", iterations,
+        [&] { return decode_json_string_like(raw).size(); });
+  micro("decode_json_string_like quoted body", iterations,
+        [&] { return decode_json_string_like(quoted).size(); });
+
+  // Children are far slower than the rest; a few hundred runs are plenty.
+  const size_t spawns = std::max<size_t>(1, std::min<size_t>(iterations, 300));
+  std::printf("-- launch and reap `true` (shell %s, %s)\n", g_config.shell.c_str(),
+              g_config.shell_mode == ShellMode::Login ? "login" : "non-login");
+  const Launcher configured = g_config.launcher;
+  const bool direct = g_config.direct_exec;
+  for (Launcher launcher : {Launcher::PosixSpawn, Launcher::Fork}) {
+    g_config.launcher = launcher;
+    const char *name = launcher == Launcher::Fork ? "fork" : "posix_spawn";
+    g_config.direct_exec = false;
+    micro((std::string(name) + " via shell").c_str(), spawns,
+          [] { return launch_and_wait("true"); });
+    g_config.direct_exec = true;
+    micro((std::string(name) + " direct exec").c_str(), spawns,
+          [] { return launch_and_wait("true"); });
+  }
+  g_config.launcher = configured;
+  g_config.direct_exec = direct;
+  micro("run_command(\"true\") end to end", spawns,
+        [] { return run_command("true").output.size(); });
+  return 0;
+}
+
+struct WorkItem {
+  std::string path;
+  std::string command;
+};
+
+struct LoadOptions {
+  std::string host = "127.0.0.1";
+  int port = 8081;
+  std::string token;
+  std::string workload;
+  double qps = 0;
+  size_t concurrency = 8;
+  double duration = 10;
+  double fresh = 0;
+};
+
+// The value of `"key": "..."` or `"key": N` in a one-line JSON object.
+bool json_field(const std::string &line, const char *key, std::string &out) {
+  const std::string needle = std::string("\"") + key + "\"";
+  size_t pos = line.find(needle);
+  if (pos == std::string::npos) return false;
+  pos = line.find(':', pos + needle.size());
+  if (pos == std::string::npos) return false;
+  ++pos;
+  while (pos < line.size() && std::isspace(static_cast<unsigned char>(line[pos]))) ++pos;
+  if (pos < line.size() && line[pos] == '"') {
+    size_t end = pos + 1;
+    while (end < line.size() && line[end] != '"') end += line[end] == '\\' ? 2 : 1;
+    out = decode_json_string_like(line.substr(pos, end + 1 - pos));
+    return true;
+  }
+  size_t end = line.find_first_of(",}", pos);
+  out = trim_copy(line.substr(pos, end == std::string::npos ? std::string::npos : end - pos));
+  return true;
+}
+
+bool load_workload(const std::string &path, std::vector<WorkItem> &items, std::string &error) {
+  if (path.empty()) {
+    items = {{"/health", ""}, {"/run", "true"}};
+    return true;
+  }
+  std::ifstream in(path);
+  if (!in) {
+    error = "cannot open " + path;
+    return false;
+  }
+  std::string line;
+  while (std::getline(in, line)) {
+    line = trim_copy(line);
+    if (line.empty() || line[0] == '#') continue;
+    WorkItem item{"/run", line};
+    size_t weight = 1;
+    if (line[0] == '{') {
+      std::string value;
+      item.command.clear();
+      if (json_field(line, "path", value)) item.path = value;
+      if (json_field(line, "command", value)) item.command = value;
+      if (json_field(line, "weight", value)) weight = std::strtoull(value.c_str(), nullptr, 10);
+    }
+    for (size_t i = 0; i < weight; ++i) items.push_back(item);
+  }
+  if (items.empty()) error = path + " has no requests";
+  return !items.empty();
+}
+
+struct PathStats {
+  std::vector<double> latencies_ms;
+  size_t errors = 0;
+};
+
+double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t i = static_cast<size_t>(std::ceil(p * static_cast<double>(sorted.size()))) - 1;
+  return sorted[std::min(i, sorted.size() - 1)];
+}
+
+// Headers and body go out in separate writes; without TCP_NODELAY every
+// POST would wait out Nagle against the server's delayed ACK.
+std::unique_ptr<httplib::Client> make_client(const LoadOptions &opts) {
+  std::unique_ptr<httplib::Client> cli(new httplib::Client(opts.host, opts.port));
+  cli->set_tcp_nodelay(true);
+  return cli;
+}
+
+int run_load(const LoadOptions &opts) {
+  std::vector<WorkItem> items;
+  std::string error;
+  if (!load_workload(opts.workload, items, error)) {
+    std::cerr << error << "\n";
+    return 1;
+  }
+
+  using Clock = std::chrono::steady_clock;
+  const auto start = Clock::now();
+  const auto stop = start + std::chrono::duration_cast<Clock::duration>(
+                                std::chrono::duration<double>(opts.duration));
+  // With a target rate each connection sends on its own fixed schedule.
+  const auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(
+      opts.qps > 0 ? static_cast<double>(opts.concurrency) / opts.qps : 0));
+
+  std::mutex mutex;
+  std::map<std::string, PathStats> stats;
+  std::vector<std::thread> threads;
+  httplib::Headers headers;
+  if (!opts.token.empty()) headers.emplace("Authorization", "Bearer " + opts.token);
+
+  for (size_t t = 0; t < opts.concurrency; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937_64 rng(t * 7919 + 1);
+      std::uniform_real_distribution<double> coin(0, 1);
+      std::unique_ptr<httplib::Client> kept;
+      std::map<std::string, PathStats> local;
+      // Stagger the connections' schedules across one interval.
+      auto due = start + interval * static_cast<long>(t) / static_cast<long>(opts.concurrency);
+
+      for (size_t n = t; due < stop; n += opts.concurrency) {
+        if (interval.count() > 0) {
+          std::this_thread::sleep_until(due);
+        } else {
+          due = Clock::now();
+        }
+
+        const WorkItem &item = items[n % items.size()];
+        std::unique_ptr<httplib::Client> fresh;
+        httplib::Client *cli;
+        if (coin(rng) < opts.fresh) {
+          fresh = make_client(opts);
+          cli = fresh.get();
+        } else {
+          if (!kept) {
+            kept = make_client(opts);
+            kept->set_keep_alive(true);
+          }
+          cli = kept.get();
+        }
+
+        httplib::Result res = item.command.empty()
+                                  ? cli->Get(item.path, headers)
+                                  : cli->Post(item.path, headers, item.command, "text/plain");
+        PathStats &s = local[item.path];
+        if (!res || res->status >= 400) {
+          ++s.errors;
+          if (!res) kept.reset();
+        }
+        s.latencies_ms.push_back(
+            std::chrono::duration<double, std::milli>(Clock::now() - due).count());
+        due += interval;
+      }
+
+      std::lock_guard<std::mutex> guard(mutex);
+      for (auto &entry : local) {
+        PathStats &s = stats[entry.first];
+        s.errors += entry.second.errors;
+        s.latencies_ms.insert(s.latencies_ms.end(), entry.second.latencies_ms.begin(),
+                              entry.second.latencies_ms.end());
+      }
+    });
+  }
+  for (auto &t : threads) t.join();
+
+  const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  std::printf("%s:%d  concurrency %zu  target %s  fresh connections %.0f%%  %.1f s\n",
+              opts.host.c_str(), opts.port, opts.concurrency,
+              opts.qps > 0 ? (std::to_string(static_cast<long>(opts.qps)) + " req/s").c_str()
+                           : "unpaced",
+              opts.fresh * 100, elapsed);
+  std::printf("%-16s %10s %8s %10s %10s %10s %10s %10s\n", "path", "requests", "errors",
+              "req/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+  for (auto &entry : stats) {
+    std::vector<double> &l = entry.second.latencies_ms;
+    std::sort(l.begin(), l.end());
+    std::printf("%-16s %10zu %8zu %10.1f %10.3f %10.3f %10.3f %10.3f\n", entry.first.c_str(),
+                l.size(), entry.second.errors, static_cast<double>(l.size()) / elapsed,
+                percentile(l, 0.50), percentile(l, 0.99), percentile(l, 0.999),
+                l.empty() ? 0 : l.back());
+  }
+  return 0;
+}
+
+int usage() {
+  std::cerr << "usage: cmd_bench micro [iterations]\n"
+               "       cmd_bench load [--host H] [--port P] [--token T] [--workload FILE]\n"
+               "                      [--qps N] [--concurrency C] [--duration S] [--fresh R]\n";
+  return 2;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  load_config_from_env();
+  if (argc < 2) return usage();
+  const std::string mode = argv[1];
+
+  if (mode == "micro") {
+    return run_micro(argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100000);
+  }
+  if (mode != "load") return usage();
+
+  LoadOptions opts;
+  opts.token = env_or("CMD_SERVICE_TOKEN", "");
+  for (int i = 2; i + 1 < argc; i += 2) {
+    const std::string flag = argv[i];
+    const char *value = argv[i + 1];
+    if (flag == "--host") {
+      opts.host = value;
+    } else if (flag == "--port") {
+      opts.port = std::atoi(value);
+    } else if (flag == "--token") {
+      opts.token = value;
+    } else if (flag == "--workload") {
+      opts.workload = value;
+    } else if (flag == "--qps") {
+      opts.qps = std::atof(value);
+    } else if (flag == "--concurrency") {
+      opts.concurrency = std::max<size_t>(1, std::strtoull(value, nullptr, 10));
+    } else if (flag == "--duration") {
+      opts.duration = std::atof(value);
+    } else if (flag == "--fresh") {
+      opts.fresh = std::atof(value);
+    } else {
+      return usage();
+    }
+  }
+  if ((argc - 2) % 2 != 0) return usage();
+  return run_load(opts);
+}
@@ -301,6 +301,9 @@ using socklen_t = int;
 #ifdef __linux__
 #include <resolv.h>
 #undef _res // Undefine _res macro to avoid conflicts with user code (#2278)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #endif
 #include <csignal>
 #include <netinet/tcp.h>
@@ -353,6 +356,13 @@ using socket_t = int;
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #if __cplusplus >= 201703L
 #include <any>
 #endif
@@ -996,6 +1006,15 @@ public:
   std::function<bool()> is_writable;
   std::function<void()> done;
   std::function<void(const Headers &trailer)> done_with_trailer;
+  // Set only when the response goes straight to a plain socket: sends
+  // `length` bytes of the regular file `fd` starting at `offset` without
+  // copying them through user space. Providers must fall back to `write`
+  // when it is empty.
+  std::function<bool(int fd, size_t offset, size_t length)> write_file;
+  // Same condition, for uncompressed chunked responses: moves exactly
+  // `length` bytes, which must already be readable, from the pipe `fd` to
+  // the socket as one chunk.
+  std::function<bool(int fd, size_t length)> write_pipe;
   std::ostream os;
 
 private:
@@ -1403,6 +1422,9 @@ public:
   virtual bool is_peer_alive() const { return wait_writable(); }
 
   virtual ssize_t read(char *ptr, size_t size) = 0;
+  // Like read(), but stops after the first '\n'. Used for the request line,
+  // headers and chunk sizes; buffered streams scan their buffer at once.
+  virtual ssize_t read_line(char *ptr, size_t size);
   virtual ssize_t write(const char *ptr, size_t size) = 0;
   virtual void get_remote_ip_and_port(std::string &ip, int &port) const = 0;
   virtual void get_local_ip_and_port(std::string &ip, int &port) const = 0;
@@ -1415,6 +1437,22 @@ public:
     (void)usec;
   }
 
+  // Zero-copy transfer from a regular file or a pipe, for streams that
+  // write straight to a socket. Returns bytes sent, or -1 if unsupported or
+  // on error.
+  virtual bool can_write_file() const { return false; }
+  virtual ssize_t write_file(int fd, size_t offset, size_t size) {
+    (void)fd;
+    (void)offset;
+    (void)size;
+    return -1;
+  }
+  virtual ssize_t write_pipe(int fd, size_t size) {
+    (void)fd;
+    (void)size;
+    return -1;
+  }
+
   ssize_t write(const char *ptr);
   ssize_t write(const std::string &s);
 
@@ -1444,6 +1482,11 @@ public:
   bool enqueue(std::function<void()> fn) override;
   void shutdown() override;
 
+  // Snapshot of the pool state, for monitoring.
+  size_t queued_count() const;
+  size_t idle_count() const;
+  size_t thread_count() const;
+
 private:
   void worker(bool is_dynamic);
   void move_to_finished(std::thread::id id);
@@ -1462,6 +1505,68 @@ private:
   std::vector<std::thread>
       finished_threads_; // exited dynamic threads awaiting join
 
+  std::condition_variable cond_;
+  mutable std::mutex mutex_;
+};
+
+namespace detail {
+
+// Bounded lock-free multi-producer/multi-consumer ring (D. Vyukov's design).
+// Cells are preallocated, so queuing a task allocates nothing beyond what
+// the std::function itself needs.
+class TaskRing {
+public:
+  explicit TaskRing(size_t capacity);
+  TaskRing(const TaskRing &) = delete;
+
+  bool push(std::function<void()> &fn);
+  bool pop(std::function<void()> &fn);
+  size_t size() const;
+
+private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    std::function<void()> fn;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+};
+
+} // namespace detail
+
+// Fixed-size pool with one lock-free queue per worker. Tasks queued from a
+// worker thread go to that worker's own queue, others are spread round-robin;
+// a worker whose queue is empty steals from the others before sleeping.
+// Optionally pins worker i to CPU i (Linux only).
+class WorkStealingThreadPool final : public TaskQueue {
+public:
+  explicit WorkStealingThreadPool(size_t n, size_t queue_capacity = 1024,
+                                  bool pin_threads = false);
+  WorkStealingThreadPool(const WorkStealingThreadPool &) = delete;
+  ~WorkStealingThreadPool() override;
+
+  bool enqueue(std::function<void()> fn) override;
+  void shutdown() override;
+
+  // Snapshot of the pool state, for monitoring.
+  size_t queued_count() const;
+  size_t idle_count() const;
+  size_t thread_count() const { return threads_.size(); }
+
+private:
+  void worker(size_t index, bool pin);
+  bool try_pop(size_t index, std::function<void()> &fn);
+  bool has_work() const;
+
+  std::vector<std::unique_ptr<detail::TaskRing>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> next_queue_{0};
+  std::atomic<size_t> sleepers_{0};
+  std::atomic<bool> shutdown_{false};
+
   std::condition_variable cond_;
   std::mutex mutex_;
 };
@@ -1496,6 +1601,15 @@ public:
   // Match request path and populate its matches and
   virtual bool match(Request &request) const = 0;
 
+  // For RouteTable: splits the pattern into path segments, a segment that
+  // starts with ':' standing for any one segment. Every path the pattern
+  // matches must reach these segments (match() still has the final say).
+  // Returns false for patterns that can't be indexed this way.
+  virtual bool route_segments(std::vector<std::string> &segments) const {
+    (void)segments;
+    return false;
+  }
+
 private:
   std::string pattern_;
 };
@@ -1523,6 +1637,7 @@ public:
   PathParamsMatcher(const std::string &pattern);
 
   bool match(Request &request) const override;
+  bool route_segments(std::vector<std::string> &segments) const override;
 
 private:
   // Treat segment separators as the end of path parameter capture
@@ -1549,15 +1664,56 @@ private:
  */
 class RegexMatcher final : public MatcherBase {
 public:
-  RegexMatcher(const std::string &pattern)
-      : MatcherBase(pattern), regex_(pattern) {}
+  RegexMatcher(const std::string &pattern);
 
+  // Patterns without regex metacharacters are compared as plain strings;
+  // Request::matches stays empty for them.
   bool match(Request &request) const override;
+  bool route_segments(std::vector<std::string> &segments) const override;
 
 private:
   std::regex regex_;
+  bool literal_ = false;
+};
+
+/**
+ * Per-method route index, built once the handlers are registered.
+ *
+ * Indexable patterns (path-parameter routes and literal paths) go into a
+ * trie keyed by path segment, with one wildcard child per node for
+ * ':param' segments. Other patterns are kept in a fallback list. A lookup
+ * collects the routes whose segments fit the path, merges them with the
+ * fallback routes in registration order, and returns the first one whose
+ * matcher accepts the request, so the result is the same as a linear scan.
+ */
+class RouteTable {
+public:
+  void build(const std::vector<const MatcherBase *> &matchers);
+
+  // Number of routes indexed; a table that is out of date with its
+  // handlers must not be used.
+  size_t size() const { return matchers_.size(); }
+
+  // Index of the matching route, or -1.
+  int find(Request &request) const;
+
+private:
+  struct Node {
+    std::unordered_map<std::string, std::unique_ptr<Node>> children;
+    std::unique_ptr<Node> param;
+    std::vector<size_t> routes;
+  };
+
+  void collect(const Node &node, const std::string &path, size_t pos,
+               std::vector<size_t> &out) const;
+
+  std::vector<const MatcherBase *> matchers_;
+  Node root_;
+  std::vector<size_t> fallback_;
 };
 
+class KeepAliveReactor;
+
 int close_socket(socket_t sock);
 
 ssize_t write_headers(Stream &strm, const Headers &headers);
@@ -1656,6 +1812,18 @@ public:
   Server &set_keep_alive_max_count(size_t count);
   Server &set_keep_alive_timeout(time_t sec);
 
+  // Linux only: park idle keep-alive connections in an epoll reactor instead
+  // of holding a worker thread per connection. Ignored on other platforms
+  // and by SSLServer.
+  Server &set_keep_alive_reactor(bool on);
+
+  // Bind `count` listening sockets to the same address with SO_REUSEPORT,
+  // each served by its own accept loop and its own task queue, so the
+  // kernel spreads incoming connections across them. Requires the socket
+  // options to set SO_REUSEPORT (the default does where it is available).
+  Server &set_listener_count(size_t count);
+  Server &set_listen_backlog(int backlog);
+
   Server &set_read_timeout(time_t sec, time_t usec = 0);
   template <class Rep, class Period>
   Server &set_read_timeout(const std::chrono::duration<Rep, Period> &duration);
@@ -1670,10 +1838,31 @@ public:
 
   Server &set_payload_max_length(size_t length);
 
+  // Buffered bodies smaller than `bytes` are sent uncompressed. Streamed
+  // bodies have no size up front and are compressed whenever negotiated.
+  Server &set_compression_threshold(size_t bytes);
+  // Codec-specific level (gzip 1-9, brotli 0-11, zstd 1-22); negative
+  // keeps each codec's default.
+  Server &set_compression_level(int level);
+
   bool bind_to_port(const std::string &host, int port, int socket_flags = 0);
   int bind_to_any_port(const std::string &host, int socket_flags = 0);
+  // Serves on sockets already bound and listening (inherited from systemd or
+  // handed over by a previous process) instead of binding; the first is the
+  // main listener. Call listen_after_bind() next.
+  bool adopt_listen_sockets(const std::vector<socket_t> &socks);
   bool listen_after_bind();
 
+  // The listening sockets, e.g. to pass to a process taking over.
+  std::vector<socket_t> listen_sockets() const;
+  // Stops accepting without shutting the listening sockets down, so another
+  // process holding them keeps accepting. Connections already accepted are
+  // served to completion (idle keep-alive ones are closed) and then listen()
+  // returns, closing this process's descriptors once no accept loop can be
+  // using them. The loops only notice between accepts, so this needs
+  // non-blocking listening sockets and an idle interval.
+  void release_listen_sockets();
+
   bool listen(const std::string &host, int port, int socket_flags = 0);
 
   bool is_running() const;
@@ -1723,6 +1912,8 @@ private:
                                 SocketOptions socket_options) const;
   int bind_internal(const std::string &host, int port, int socket_flags);
   bool listen_internal();
+  bool accept_loop(std::atomic<socket_t> &svr_sock);
+  void close_extra_listeners();
 
   bool routing(Request &req, Response &res, Stream &strm);
   bool handle_file_request(Request &req, Response &res);
@@ -1730,11 +1921,13 @@ private:
                              const std::string &etag, time_t mtime) const;
   bool check_if_range(Request &req, const std::string &etag,
                       time_t mtime) const;
-  bool dispatch_request(Request &req, Response &res,
-                        const Handlers &handlers) const;
+  bool dispatch_request(Request &req, Response &res, const Handlers &handlers,
+                        const detail::RouteTable &routes) const;
   bool dispatch_request_for_content_reader(
       Request &req, Response &res, ContentReader content_reader,
-      const HandlersForContentReader &handlers) const;
+      const HandlersForContentReader &handlers,
+      const detail::RouteTable &routes) const;
+  void build_route_tables();
 
   bool parse_request_line(const char *s, Request &req) const;
   void apply_ranges(const Request &req, Response &res,
@@ -1761,6 +1954,9 @@ private:
                          ContentReceiver multipart_receiver) const;
 
   virtual bool process_and_close_socket(socket_t sock);
+  virtual bool supports_keep_alive_reactor() const { return true; }
+  void process_reactor_socket(socket_t sock, size_t remaining,
+                              detail::KeepAliveReactor &reactor);
 
   void output_log(const Request &req, const Response &res) const;
   void output_pre_compression_log(const Request &req,
@@ -1791,6 +1987,17 @@ private:
   HandlersForContentReader delete_handlers_for_content_reader_;
   Handlers options_handlers_;
 
+  detail::RouteTable get_routes_;
+  detail::RouteTable post_routes_;
+  detail::RouteTable post_routes_for_content_reader_;
+  detail::RouteTable put_routes_;
+  detail::RouteTable put_routes_for_content_reader_;
+  detail::RouteTable patch_routes_;
+  detail::RouteTable patch_routes_for_content_reader_;
+  detail::RouteTable delete_routes_;
+  detail::RouteTable delete_routes_for_content_reader_;
+  detail::RouteTable options_routes_;
+
   struct WebSocketHandlerEntry {
     std::unique_ptr<detail::MatcherBase> matcher;
     WebSocketHandler handler;
@@ -1819,6 +2026,19 @@ private:
   Headers default_headers_;
   std::function<ssize_t(Stream &, Headers &)> header_writer_ =
       detail::write_headers;
+
+  bool keep_alive_reactor_ = false;
+
+  size_t compression_threshold_ = 0;
+  int compression_level_ = -1;
+
+  size_t listener_count_ = 1;
+  int listen_backlog_ = CPPHTTPLIB_LISTEN_BACKLOG;
+  std::vector<std::unique_ptr<std::atomic<socket_t>>> extra_svr_socks_;
+  // Listening sockets taken out of the accept loops by
+  // release_listen_sockets(); closed once the loops have exited.
+  std::mutex released_socks_mutex_;
+  std::vector<socket_t> released_socks_;
 };
 
 class Result {
@@ -2639,6 +2859,7 @@ public:
 
 private:
   bool process_and_close_socket(socket_t sock) override;
+  bool supports_keep_alive_reactor() const override { return false; }
 
   tls::ctx_t ctx_ = nullptr;
   std::mutex ctx_mutex_;
@@ -3056,6 +3277,9 @@ public:
   typedef std::function<bool(const char *data, size_t data_len)> Callback;
   virtual bool compress(const char *data, size_t data_length, bool last,
                         Callback callback) = 0;
+
+  // True when compress() passes data through unchanged.
+  virtual bool is_identity() const { return false; }
 };
 
 class decompressor {
@@ -3075,12 +3299,18 @@ public:
 
   bool compress(const char *data, size_t data_length, bool /*last*/,
                 Callback callback) override;
+  bool is_identity() const override { return true; }
 };
 
+// Compressor for `type` at `level` (negative: the codec's default), with the
+// matching Content-Encoding token; nullptr if the codec isn't compiled in.
+std::unique_ptr<compressor> make_compressor(EncodingType type, int level,
+                                            std::string &content_encoding);
+
 #ifdef CPPHTTPLIB_ZLIB_SUPPORT
 class gzip_compressor final : public compressor {
 public:
-  gzip_compressor();
+  explicit gzip_compressor(int level = Z_DEFAULT_COMPRESSION);
   ~gzip_compressor() override;
 
   bool compress(const char *data, size_t data_length, bool last,
@@ -3110,7 +3340,8 @@ private:
 #ifdef CPPHTTPLIB_BROTLI_SUPPORT
 class brotli_compressor final : public compressor {
 public:
-  brotli_compressor();
+  // A negative quality keeps the encoder's default.
+  explicit brotli_compressor(int quality = -1);
   ~brotli_compressor();
 
   bool compress(const char *data, size_t data_length, bool last,
@@ -3139,7 +3370,7 @@ private:
 #ifdef CPPHTTPLIB_ZSTD_SUPPORT
 class zstd_compressor : public compressor {
 public:
-  zstd_compressor();
+  explicit zstd_compressor(int level = ZSTD_fast);
   ~zstd_compressor();
 
   bool compress(const char *data, size_t data_length, bool last,
@@ -3176,7 +3407,7 @@ public:
   bool getline();
 
 private:
-  void append(char c);
+  void append(const char *data, size_t n);
 
   Stream &strm_;
   char *fixed_buffer_;
@@ -3188,6 +3419,39 @@ private:
 bool parse_trailers(stream_line_reader &line_reader, Headers &dest,
                     const Headers &src_headers);
 
+/**
+ * Per-thread cache that lets consecutive requests on a worker reuse the
+ * previous request's allocations instead of freeing and reallocating them:
+ * header map nodes (C++17 node handles), the header maps' bucket arrays
+ * and the request and response body buffers. A worker serves one
+ * connection at a time, so this acts as a per-connection arena that is
+ * reset in one step between keep-alive requests.
+ */
+class RequestRecycler {
+public:
+  // Gives a fresh request/response the cached containers and copies the
+  // server's default headers into the response.
+  void acquire(Request &req, Response &res, const Headers &default_headers);
+  // Takes the containers back after the response has been written.
+  void release(Request &req, Response &res);
+
+  void emplace(Headers &headers, const std::string &key,
+               const std::string &val);
+
+private:
+  void recycle(Headers &headers);
+
+#if __cplusplus >= 201703L
+  std::vector<Headers::node_type> nodes_;
+#endif
+  Headers req_headers_;
+  Headers res_headers_;
+  std::string req_body_;
+  std::string res_body_;
+};
+
+RequestRecycler &request_recycler();
+
 struct ChunkedDecoder {
   Stream &strm;
   size_t chunk_remaining = 0;
@@ -3215,6 +3479,9 @@ public:
   bool is_open() const;
   size_t size() const;
   const char *data() const;
+#ifndef _WIN32
+  int fd() const { return fd_; }
+#endif
 
 private:
 #if defined(_WIN32)
@@ -3228,6 +3495,10 @@ private:
   bool is_open_empty_file = false;
 };
 
+// Sends a slice of a mapped file, with sendfile(2) when the sink allows it.
+bool write_mapped_file(const mmap &mm, size_t offset, size_t length,
+                       DataSink &sink);
+
 // NOTE: https://www.rfc-editor.org/rfc/rfc9110#section-5
 namespace fields {
 
@@ -4903,6 +5174,42 @@ inline std::string file_extension(const std::string &path) {
 
 inline bool is_space_or_tab(char c) { return c == ' ' || c == '\t'; }
 
+// Returns the first occurrence of `c` in [p, end), or `end`. Compares 32 or
+// 16 bytes per step where AVX2, SSE2 or NEON is available.
+inline const char *find_byte(const char *p, const char *end, char c) {
+#if defined(__AVX2__)
+  const auto needle32 = _mm256_set1_epi8(c);
+  while (end - p >= 32) {
+    auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    auto mask = static_cast<unsigned>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle32)));
+    if (mask) { return p + __builtin_ctz(mask); }
+    p += 32;
+  }
+#endif
+#if defined(__SSE2__)
+  const auto needle16 = _mm_set1_epi8(c);
+  while (end - p >= 16) {
+    auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    auto mask = static_cast<unsigned>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle16)));
+    if (mask) { return p + __builtin_ctz(mask); }
+    p += 16;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const auto needle16 = vdupq_n_u8(static_cast<uint8_t>(c));
+  while (end - p >= 16) {
+    auto chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+    if (vmaxvq_u8(vceqq_u8(chunk, needle16))) { break; }
+    p += 16;
+  }
+#endif
+  while (p < end && *p != c) {
+    p++;
+  }
+  return p;
+}
+
 template <typename T>
 inline bool parse_header(const char *beg, const char *end, T fn);
 
@@ -4913,10 +5220,7 @@ inline bool parse_header(const char *beg, const char *end, T fn) {
     end--;
   }
 
-  auto p = beg;
-  while (p < end && *p != ':') {
-    p++;
-  }
+  auto p = find_byte(beg, end, ':');
 
   auto name = std::string(beg, p);
   if (!detail::fields::is_field_name(name)) { return false; }
@@ -5183,18 +5487,17 @@ inline bool stream_line_reader::getline() {
   fixed_buffer_used_size_ = 0;
   growable_buffer_.clear();
 
-#ifndef CPPHTTPLIB_ALLOW_LF_AS_LINE_TERMINATOR
-  char prev_byte = 0;
-#endif
-
   for (size_t i = 0;; i++) {
     if (size() >= CPPHTTPLIB_MAX_LINE_LENGTH) {
       // Treat exceptionally long lines as an error to
       // prevent infinite loops/memory exhaustion
       return false;
     }
-    char byte;
-    auto n = strm_.read(&byte, 1);
+    char chunk[1024];
+    auto room = (std::min)(sizeof(chunk),
+                           static_cast<size_t>(CPPHTTPLIB_MAX_LINE_LENGTH) -
+                               size());
+    auto n = strm_.read_line(chunk, room);
 
     if (n < 0) {
       return false;
@@ -5206,29 +5509,31 @@ inline bool stream_line_reader::getline() {
       }
     }
 
-    append(byte);
+    append(chunk, static_cast<size_t>(n));
 
+    if (chunk[n - 1] != '\n') { continue; }
 #ifdef CPPHTTPLIB_ALLOW_LF_AS_LINE_TERMINATOR
-    if (byte == '\n') { break; }
+    break;
 #else
-    if (prev_byte == '\r' && byte == '\n') { break; }
-    prev_byte = byte;
+    if (size() >= 2 && ptr()[size() - 2] == '\r') { break; }
 #endif
   }
 
   return true;
 }
 
-inline void stream_line_reader::append(char c) {
-  if (fixed_buffer_used_size_ < fixed_buffer_size_ - 1) {
-    fixed_buffer_[fixed_buffer_used_size_++] = c;
+inline void stream_line_reader::append(const char *data, size_t n) {
+  if (growable_buffer_.empty() &&
+      fixed_buffer_used_size_ + n < fixed_buffer_size_) {
+    memcpy(fixed_buffer_ + fixed_buffer_used_size_, data, n);
+    fixed_buffer_used_size_ += n;
     fixed_buffer_[fixed_buffer_used_size_] = '\0';
   } else {
     if (growable_buffer_.empty()) {
       assert(fixed_buffer_[fixed_buffer_used_size_] == '\0');
       growable_buffer_.assign(fixed_buffer_, fixed_buffer_used_size_);
     }
-    growable_buffer_ += c;
+    growable_buffer_.append(data, n);
   }
 }
 
@@ -5311,6 +5616,16 @@ inline bool mmap::is_open() const {
 
 inline size_t mmap::size() const { return size_; }
 
+inline bool write_mapped_file(const mmap &mm, size_t offset, size_t length,
+                              DataSink &sink) {
+#ifndef _WIN32
+  if (sink.write_file && mm.fd() != -1) {
+    return sink.write_file(mm.fd(), offset, length);
+  }
+#endif
+  return sink.write(mm.data() + offset, length);
+}
+
 inline const char *mmap::data() const {
   return is_open_empty_file ? "" : static_cast<const char *>(addr_);
 }
@@ -5471,12 +5786,18 @@ public:
   bool wait_writable() const override;
   bool is_peer_alive() const override;
   ssize_t read(char *ptr, size_t size) override;
+  ssize_t read_line(char *ptr, size_t size) override;
   ssize_t write(const char *ptr, size_t size) override;
   void get_remote_ip_and_port(std::string &ip, int &port) const override;
   void get_local_ip_and_port(std::string &ip, int &port) const override;
   socket_t socket() const override;
   time_t duration() const override;
   void set_read_timeout(time_t sec, time_t usec = 0) override;
+#ifdef __linux__
+  bool can_write_file() const override { return true; }
+  ssize_t write_file(int fd, size_t offset, size_t size) override;
+  ssize_t write_pipe(int fd, size_t size) override;
+#endif
 
 private:
   socket_t sock_;
@@ -5491,7 +5812,7 @@ private:
   size_t read_buff_off_ = 0;
   size_t read_buff_content_size_ = 0;
 
-  static const size_t read_buff_size_ = 1024l * 4;
+  static const size_t read_buff_size_ = CPPHTTPLIB_RECV_BUFSIZ;
 };
 
 inline bool keep_alive(const std::atomic<socket_t> &svr_sock, socket_t sock,
@@ -5527,15 +5848,19 @@ inline bool keep_alive(const std::atomic<socket_t> &svr_sock, socket_t sock,
   return false;
 }
 
+// `strm`, when the connection keeps one stream throughout, may already hold
+// the next (pipelined) request; then there is nothing to wait for.
 template <typename T>
 inline bool
 process_server_socket_core(const std::atomic<socket_t> &svr_sock, socket_t sock,
                            size_t keep_alive_max_count,
-                           time_t keep_alive_timeout_sec, T callback) {
+                           time_t keep_alive_timeout_sec, T callback,
+                           const Stream *strm = nullptr) {
   assert(keep_alive_max_count > 0);
   auto ret = false;
   auto count = keep_alive_max_count;
-  while (count > 0 && keep_alive(svr_sock, sock, keep_alive_timeout_sec)) {
+  while (count > 0 && ((strm && strm->is_readable()) ||
+                       keep_alive(svr_sock, sock, keep_alive_timeout_sec))) {
     auto close_connection = count == 1;
     auto connection_closed = false;
     ret = callback(close_connection, connection_closed);
@@ -5552,13 +5877,16 @@ process_server_socket(const std::atomic<socket_t> &svr_sock, socket_t sock,
                       time_t keep_alive_timeout_sec, time_t read_timeout_sec,
                       time_t read_timeout_usec, time_t write_timeout_sec,
                       time_t write_timeout_usec, T callback) {
+  // One stream for the connection's lifetime: whatever it read past the end
+  // of one request is the start of the next pipelined one, not lost.
+  SocketStream strm(sock, read_timeout_sec, read_timeout_usec,
+                    write_timeout_sec, write_timeout_usec);
   return process_server_socket_core(
       svr_sock, sock, keep_alive_max_count, keep_alive_timeout_sec,
       [&](bool close_connection, bool &connection_closed) {
-        SocketStream strm(sock, read_timeout_sec, read_timeout_usec,
-                          write_timeout_sec, write_timeout_usec);
         return callback(strm, close_connection, connection_closed);
-      });
+      },
+      &strm);
 }
 
 inline bool process_client_socket(
@@ -5581,6 +5909,147 @@ inline int shutdown_socket(socket_t sock) {
 #endif
 }
 
+#ifdef __linux__
+// Holds idle keep-alive connections in epoll so they do not occupy a worker
+// thread. A parked connection is passed to `dispatch` as soon as it becomes
+// readable, or closed once it has been idle for the keep-alive timeout.
+class KeepAliveReactor {
+public:
+  using Dispatch = std::function<bool(socket_t sock, size_t remaining)>;
+
+  KeepAliveReactor(time_t keep_alive_timeout_sec, Dispatch dispatch);
+  KeepAliveReactor(const KeepAliveReactor &) = delete;
+  ~KeepAliveReactor();
+
+  bool is_valid() const { return epfd_ >= 0 && wakeup_fd_ >= 0; }
+
+  // `remaining` is the number of requests still allowed on the connection.
+  // Returns false (and leaves the socket to the caller) once stopped.
+  bool park(socket_t sock, size_t remaining);
+
+  // Stops dispatching and closes every parked connection.
+  void stop();
+
+private:
+  struct Entry {
+    size_t remaining;
+    std::chrono::steady_clock::time_point expires_at;
+  };
+
+  void run();
+
+  int epfd_ = -1;
+  int wakeup_fd_ = -1;
+  std::chrono::seconds timeout_;
+  Dispatch dispatch_;
+  std::mutex mutex_;
+  std::unordered_map<socket_t, Entry> parked_;
+  bool stopped_ = false;
+  std::thread thread_;
+};
+
+inline KeepAliveReactor::KeepAliveReactor(time_t keep_alive_timeout_sec,
+                                          Dispatch dispatch)
+    : timeout_(keep_alive_timeout_sec), dispatch_(std::move(dispatch)) {
+  epfd_ = epoll_create1(EPOLL_CLOEXEC);
+  wakeup_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (!is_valid()) { return; }
+
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.fd = wakeup_fd_;
+  epoll_ctl(epfd_, EPOLL_CTL_ADD, wakeup_fd_, &ev);
+  thread_ = std::thread([this]() { run(); });
+}
+
+inline KeepAliveReactor::~KeepAliveReactor() {
+  stop();
+  if (epfd_ >= 0) { ::close(epfd_); }
+  if (wakeup_fd_ >= 0) { ::close(wakeup_fd_); }
+}
+
+inline bool KeepAliveReactor::park(socket_t sock, size_t remaining) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (stopped_ || !is_valid()) { return false; }
+
+  epoll_event ev{};
+  ev.events = EPOLLIN | EPOLLRDHUP;
+  ev.data.fd = sock;
+  if (epoll_ctl(epfd_, EPOLL_CTL_ADD, sock, &ev) != 0) { return false; }
+  parked_[sock] = {remaining, std::chrono::steady_clock::now() + timeout_};
+  return true;
+}
+
+inline void KeepAliveReactor::stop() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (stopped_) { return; }
+    stopped_ = true;
+  }
+  if (wakeup_fd_ >= 0) {
+    uint64_t one = 1;
+    auto ret = ::write(wakeup_fd_, &one, sizeof(one));
+    (void)ret;
+  }
+  if (thread_.joinable()) { thread_.join(); }
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (auto &item : parked_) {
+    shutdown_socket(item.first);
+    close_socket(item.first);
+  }
+  parked_.clear();
+}
+
+inline void KeepAliveReactor::run() {
+  // Expiry is checked on every wake-up, and at least this often.
+  const int tick_msec = 100;
+  std::vector<epoll_event> events(256);
+  std::vector<std::pair<socket_t, size_t>> ready;
+
+  for (;;) {
+    auto n = epoll_wait(epfd_, events.data(), static_cast<int>(events.size()),
+                        tick_msec);
+    if (n < 0 && errno != EINTR) { break; }
+
+    ready.clear();
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if (stopped_) { break; }
+
+      for (int i = 0; i < n; i++) {
+        auto sock = events[static_cast<size_t>(i)].data.fd;
+        if (sock == wakeup_fd_) { continue; }
+        auto it = parked_.find(sock);
+        if (it == parked_.end()) { continue; }
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, sock, nullptr);
+        ready.emplace_back(sock, it->second.remaining);
+        parked_.erase(it);
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      for (auto it = parked_.begin(); it != parked_.end();) {
+        if (it->second.expires_at <= now) {
+          epoll_ctl(epfd_, EPOLL_CTL_DEL, it->first, nullptr);
+          shutdown_socket(it->first);
+          close_socket(it->first);
+          it = parked_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    for (const auto &item : ready) {
+      if (!dispatch_(item.first, item.second)) {
+        shutdown_socket(item.first);
+        close_socket(item.first);
+      }
+    }
+  }
+}
+#endif
+
 inline std::string escape_abstract_namespace_unix_domain(const std::string &s) {
   if (s.size() > 1 && s[0] == '\0') {
     auto ret = s;
@@ -6428,6 +6897,31 @@ inline EncodingType encoding_type(const Request &req, const Response &res) {
   return EncodingType::None;
 }
 
+inline std::unique_ptr<compressor>
+make_compressor(EncodingType type, int level, std::string &content_encoding) {
+  (void)level;
+  (void)content_encoding;
+  if (type == EncodingType::Gzip) {
+#ifdef CPPHTTPLIB_ZLIB_SUPPORT
+    content_encoding = "gzip";
+    return detail::make_unique<gzip_compressor>(
+        level < 0 ? Z_DEFAULT_COMPRESSION : (std::min)(level, 9));
+#endif
+  } else if (type == EncodingType::Brotli) {
+#ifdef CPPHTTPLIB_BROTLI_SUPPORT
+    content_encoding = "br";
+    return detail::make_unique<brotli_compressor>(level);
+#endif
+  } else if (type == EncodingType::Zstd) {
+#ifdef CPPHTTPLIB_ZSTD_SUPPORT
+    content_encoding = "zstd";
+    return detail::make_unique<zstd_compressor>(level < 0 ? ZSTD_fast
+                                                          : level);
+#endif
+  }
+  return nullptr;
+}
+
 inline bool nocompressor::compress(const char *data, size_t data_length,
                                    bool /*last*/, Callback callback) {
   if (!data_length) { return true; }
@@ -6435,13 +6929,13 @@ inline bool nocompressor::compress(const char *data, size_t data_length,
 }
 
 #ifdef CPPHTTPLIB_ZLIB_SUPPORT
-inline gzip_compressor::gzip_compressor() {
+inline gzip_compressor::gzip_compressor(int level) {
   std::memset(&strm_, 0, sizeof(strm_));
   strm_.zalloc = Z_NULL;
   strm_.zfree = Z_NULL;
   strm_.opaque = Z_NULL;
 
-  is_valid_ = deflateInit2(&strm_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8,
+  is_valid_ = deflateInit2(&strm_, level, Z_DEFLATED, 31, 8,
                            Z_DEFAULT_STRATEGY) == Z_OK;
 }
 
@@ -6548,8 +7042,13 @@ inline bool gzip_decompressor::decompress(const char *data, size_t data_length,
 #endif
 
 #ifdef CPPHTTPLIB_BROTLI_SUPPORT
-inline brotli_compressor::brotli_compressor() {
+inline brotli_compressor::brotli_compressor(int quality) {
   state_ = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
+  if (quality >= 0) {
+    BrotliEncoderSetParameter(
+        state_, BROTLI_PARAM_QUALITY,
+        static_cast<uint32_t>((std::min)(quality, BROTLI_MAX_QUALITY)));
+  }
 }
 
 inline brotli_compressor::~brotli_compressor() {
@@ -6634,9 +7133,9 @@ inline bool brotli_decompressor::decompress(const char *data,
 #endif
 
 #ifdef CPPHTTPLIB_ZSTD_SUPPORT
-inline zstd_compressor::zstd_compressor() {
+inline zstd_compressor::zstd_compressor(int level) {
   ctx_ = ZSTD_createCCtx();
-  ZSTD_CCtx_setParameter(ctx_, ZSTD_c_compressionLevel, ZSTD_fast);
+  ZSTD_CCtx_setParameter(ctx_, ZSTD_c_compressionLevel, level);
 }
 
 inline zstd_compressor::~zstd_compressor() { ZSTD_freeCCtx(ctx_); }
@@ -6745,7 +7244,68 @@ inline const char *get_header_value(const Headers &headers,
   return def;
 }
 
-inline bool read_headers(Stream &strm, Headers &headers) {
+inline void RequestRecycler::acquire(Request &req, Response &res,
+                                     const Headers &default_headers) {
+  req.headers.swap(req_headers_);
+  req.body.swap(req_body_);
+  res.headers.swap(res_headers_);
+  res.body.swap(res_body_);
+  for (const auto &kv : default_headers) {
+    emplace(res.headers, kv.first, kv.second);
+  }
+}
+
+inline void RequestRecycler::release(Request &req, Response &res) {
+  // Large bodies are let go rather than pinned to the thread.
+  const size_t max_body_capacity = 64 * 1024;
+
+  recycle(req.headers);
+  recycle(res.headers);
+  req.headers.swap(req_headers_);
+  res.headers.swap(res_headers_);
+
+  if (req.body.capacity() <= max_body_capacity) {
+    req.body.clear();
+    req.body.swap(req_body_);
+  }
+  if (res.body.capacity() <= max_body_capacity) {
+    res.body.clear();
+    res.body.swap(res_body_);
+  }
+}
+
+inline void RequestRecycler::emplace(Headers &headers, const std::string &key,
+                                     const std::string &val) {
+#if __cplusplus >= 201703L
+  if (!nodes_.empty()) {
+    auto node = std::move(nodes_.back());
+    nodes_.pop_back();
+    node.key() = key;
+    node.mapped() = val;
+    headers.insert(std::move(node));
+    return;
+  }
+#endif
+  headers.emplace(key, val);
+}
+
+inline void RequestRecycler::recycle(Headers &headers) {
+#if __cplusplus >= 201703L
+  const size_t max_nodes = 2 * CPPHTTPLIB_HEADER_MAX_COUNT;
+  while (!headers.empty() && nodes_.size() < max_nodes) {
+    nodes_.push_back(headers.extract(headers.begin()));
+  }
+#endif
+  headers.clear();
+}
+
+inline RequestRecycler &request_recycler() {
+  static thread_local RequestRecycler recycler;
+  return recycler;
+}
+
+inline bool read_headers(Stream &strm, Headers &headers,
+                         RequestRecycler *recycler = nullptr) {
   const auto bufsiz = 2048;
   char buf[bufsiz];
   stream_line_reader line_reader(strm, buf, bufsiz);
@@ -6780,7 +7340,11 @@ inline bool read_headers(Stream &strm, Headers &headers) {
 
     if (!parse_header(line_reader.ptr(), end,
                       [&](const std::string &key, const std::string &val) {
-                        headers.emplace(key, val);
+                        if (recycler) {
+                          recycler->emplace(headers, key, val);
+                        } else {
+                          headers.emplace(key, val);
+                        }
                       })) {
       return false;
     }
@@ -7123,6 +7687,27 @@ inline bool write_content_with_progress(Stream &strm,
     return ok;
   };
 
+  if (strm.can_write_file()) {
+    data_sink.write_file = [&](int fd, size_t file_offset, size_t l) -> bool {
+      while (ok && l > 0) {
+        auto n = strm.write_file(fd, file_offset, l);
+        if (n <= 0) {
+          ok = false;
+          break;
+        }
+        auto sent = static_cast<size_t>(n);
+        file_offset += sent;
+        offset += sent;
+        l -= sent;
+
+        if (upload_progress && length > 0) {
+          if (!upload_progress(offset - start_offset, length)) { ok = false; }
+        }
+      }
+      return ok;
+    };
+  }
+
   data_sink.is_writable = [&]() -> bool { return strm.is_peer_alive(); };
 
   while (offset < end_offset && !is_shutting_down()) {
@@ -7232,6 +7817,27 @@ write_content_chunked(Stream &strm, const ContentProvider &content_provider,
     return ok;
   };
 
+  if (compressor.is_identity() && strm.can_write_file()) {
+    data_sink.write_pipe = [&](int fd, size_t l) -> bool {
+      if (!ok || l == 0) { return ok; }
+      data_available = true;
+      offset += l;
+
+      auto header = from_i_to_hex(l) + "\r\n";
+      if (!write_data(strm, header.data(), header.size())) { ok = false; }
+      while (ok && l > 0) {
+        auto n = strm.write_pipe(fd, l);
+        if (n <= 0) {
+          ok = false;
+          break;
+        }
+        l -= static_cast<size_t>(n);
+      }
+      if (ok && !write_data(strm, "\r\n", 2)) { ok = false; }
+      return ok;
+    };
+  }
+
   data_sink.is_writable = [&]() -> bool { return strm.is_peer_alive(); };
 
   auto done_with_trailer = [&](const Headers *trailer) {
@@ -9623,6 +10229,17 @@ Result::get_request_header_value_count(const std::string &key) const {
 }
 
 // Stream implementation
+inline ssize_t Stream::read_line(char *ptr, size_t size) {
+  size_t n = 0;
+  while (n < size) {
+    auto ret = read(ptr + n, 1);
+    if (ret < 0) { return n ? static_cast<ssize_t>(n) : ret; }
+    if (ret == 0) { break; }
+    if (ptr[n++] == '\n') { break; }
+  }
+  return static_cast<ssize_t>(n);
+}
+
 inline ssize_t Stream::write(const char *ptr) {
   return write(ptr, strlen(ptr));
 }
@@ -9770,6 +10387,21 @@ inline void ThreadPool::shutdown() {
   cleanup_finished_threads();
 }
 
+inline size_t ThreadPool::queued_count() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return jobs_.size();
+}
+
+inline size_t ThreadPool::idle_count() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return idle_thread_count_;
+}
+
+inline size_t ThreadPool::thread_count() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return threads_.size() + dynamic_threads_.size();
+}
+
 inline void ThreadPool::move_to_finished(std::thread::id id) {
   // Must be called with mutex_ held
   for (auto it = dynamic_threads_.begin(); it != dynamic_threads_.end(); ++it) {
@@ -9837,6 +10469,213 @@ inline void ThreadPool::worker(bool is_dynamic) {
 #endif
 }
 
+// WorkStealingThreadPool implementation
+namespace detail {
+
+inline TaskRing::TaskRing(size_t capacity) {
+  size_t n = 2;
+  while (n < capacity) {
+    n <<= 1;
+  }
+  cells_.reset(new Cell[n]);
+  mask_ = n - 1;
+  for (size_t i = 0; i < n; i++) {
+    cells_[i].seq.store(i, std::memory_order_relaxed);
+  }
+}
+
+inline bool TaskRing::push(std::function<void()> &fn) {
+  auto pos = tail_.load(std::memory_order_relaxed);
+  Cell *cell;
+  for (;;) {
+    cell = &cells_[pos & mask_];
+    auto seq = cell->seq.load(std::memory_order_acquire);
+    auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      if (tail_.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false; // Full
+    } else {
+      pos = tail_.load(std::memory_order_relaxed);
+    }
+  }
+  cell->fn = std::move(fn);
+  cell->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+inline bool TaskRing::pop(std::function<void()> &fn) {
+  auto pos = head_.load(std::memory_order_relaxed);
+  Cell *cell;
+  for (;;) {
+    cell = &cells_[pos & mask_];
+    auto seq = cell->seq.load(std::memory_order_acquire);
+    auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+    if (diff == 0) {
+      if (head_.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false; // Empty
+    } else {
+      pos = head_.load(std::memory_order_relaxed);
+    }
+  }
+  fn = std::move(cell->fn);
+  cell->fn = nullptr;
+  cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+  return true;
+}
+
+inline size_t TaskRing::size() const {
+  auto tail = tail_.load(std::memory_order_relaxed);
+  auto head = head_.load(std::memory_order_relaxed);
+  return tail > head ? tail - head : 0;
+}
+
+// Identifies the pool and queue of the current worker thread, if any.
+struct WorkStealingWorkerSlot {
+  const void *pool = nullptr;
+  size_t index = 0;
+};
+
+inline WorkStealingWorkerSlot &work_stealing_worker_slot() {
+  static thread_local WorkStealingWorkerSlot slot;
+  return slot;
+}
+
+} // namespace detail
+
+inline WorkStealingThreadPool::WorkStealingThreadPool(size_t n,
+                                                      size_t queue_capacity,
+                                                      bool pin_threads) {
+  if (n == 0) { n = 1; }
+  queues_.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    queues_.emplace_back(new detail::TaskRing(queue_capacity));
+  }
+  threads_.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    threads_.emplace_back([this, i, pin_threads]() { worker(i, pin_threads); });
+  }
+}
+
+inline WorkStealingThreadPool::~WorkStealingThreadPool() { shutdown(); }
+
+inline bool WorkStealingThreadPool::enqueue(std::function<void()> fn) {
+  if (shutdown_.load()) { return false; }
+
+  const auto &slot = detail::work_stealing_worker_slot();
+  auto start = slot.pool == this
+                   ? slot.index
+                   : next_queue_.fetch_add(1, std::memory_order_relaxed);
+  auto pushed = false;
+  for (size_t i = 0; i < queues_.size() && !pushed; i++) {
+    pushed = queues_[(start + i) % queues_.size()]->push(fn);
+  }
+  if (!pushed) { return false; }
+
+  // Pairs with the fence in worker(): either the worker sees the task when
+  // it re-checks, or we see it sleeping and wake it.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers_.load() > 0) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.notify_one();
+  }
+  return true;
+}
+
+inline void WorkStealingThreadPool::shutdown() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    shutdown_ = true;
+  }
+  cond_.notify_all();
+  for (auto &t : threads_) {
+    if (t.joinable()) { t.join(); }
+  }
+}
+
+inline size_t WorkStealingThreadPool::queued_count() const {
+  size_t n = 0;
+  for (const auto &q : queues_) {
+    n += q->size();
+  }
+  return n;
+}
+
+inline size_t WorkStealingThreadPool::idle_count() const {
+  return sleepers_.load(std::memory_order_relaxed);
+}
+
+inline bool WorkStealingThreadPool::try_pop(size_t index,
+                                            std::function<void()> &fn) {
+  if (queues_[index]->pop(fn)) { return true; }
+  for (size_t i = 1; i < queues_.size(); i++) {
+    if (queues_[(index + i) % queues_.size()]->pop(fn)) { return true; }
+  }
+  return false;
+}
+
+inline bool WorkStealingThreadPool::has_work() const {
+  for (const auto &q : queues_) {
+    if (q->size() > 0) { return true; }
+  }
+  return false;
+}
+
+inline void WorkStealingThreadPool::worker(size_t index, bool pin) {
+#ifdef __linux__
+  if (pin) {
+    auto cpus = std::thread::hardware_concurrency();
+    if (cpus > 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(index % cpus, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+  }
+#else
+  (void)pin;
+#endif
+
+  auto &slot = detail::work_stealing_worker_slot();
+  slot.pool = this;
+  slot.index = index;
+
+  std::function<void()> fn;
+  for (;;) {
+    if (try_pop(index, fn)) {
+      fn();
+      fn = nullptr;
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    sleepers_.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!has_work()) {
+      if (shutdown_.load()) {
+        sleepers_.fetch_sub(1);
+        break;
+      }
+      cond_.wait(lock);
+    }
+    sleepers_.fetch_sub(1);
+  }
+
+  slot.pool = nullptr;
+
+#if defined(CPPHTTPLIB_OPENSSL_SUPPORT) && !defined(OPENSSL_IS_BORINGSSL) &&   \
+    !defined(LIBRESSL_VERSION_NUMBER)
+  OPENSSL_thread_stop();
+#endif
+}
+
 /*
  * Group 1 (continued): detail namespace - Stream implementations
  */
@@ -9960,6 +10799,28 @@ inline ssize_t SocketStream::read(char *ptr, size_t size) {
   }
 }
 
+inline ssize_t SocketStream::read_line(char *ptr, size_t size) {
+  if (size == 0) { return 0; }
+
+  // An empty buffer is refilled by a one-byte read.
+  size_t n = 0;
+  if (read_buff_off_ >= read_buff_content_size_) {
+    auto ret = read(ptr, 1);
+    if (ret <= 0) { return ret; }
+    n = 1;
+    if (ptr[0] == '\n' || size == 1) { return 1; }
+  }
+
+  auto begin = read_buff_.data() + read_buff_off_;
+  auto end = begin + (std::min)(size - n,
+                                read_buff_content_size_ - read_buff_off_);
+  auto nl = find_byte(begin, end, '\n');
+  auto len = static_cast<size_t>((nl == end ? end : nl + 1) - begin);
+  memcpy(ptr + n, begin, len);
+  read_buff_off_ += len;
+  return static_cast<ssize_t>(n + len);
+}
+
 inline ssize_t SocketStream::write(const char *ptr, size_t size) {
   if (!wait_writable()) { return -1; }
 
@@ -9971,6 +10832,24 @@ inline ssize_t SocketStream::write(const char *ptr, size_t size) {
   return send_socket(sock_, ptr, size, CPPHTTPLIB_SEND_FLAGS);
 }
 
+#ifdef __linux__
+inline ssize_t SocketStream::write_file(int fd, size_t offset, size_t size) {
+  if (!wait_writable()) { return -1; }
+
+  auto off = static_cast<off_t>(offset);
+  return handle_EINTR([&]() { return ::sendfile(sock_, fd, &off, size); });
+}
+
+inline ssize_t SocketStream::write_pipe(int fd, size_t size) {
+  if (!wait_writable()) { return -1; }
+
+  return handle_EINTR([&]() {
+    return ::splice(fd, nullptr, sock_, nullptr, size,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+  });
+}
+#endif
+
 inline void SocketStream::get_remote_ip_and_port(std::string &ip,
                                                  int &port) const {
   return detail::get_remote_ip_and_port(sock_, ip, port);
@@ -10120,11 +10999,154 @@ inline bool PathParamsMatcher::match(Request &request) const {
   return starting_pos >= request.path.length();
 }
 
+inline bool PathParamsMatcher::route_segments(
+    std::vector<std::string> &segments) const {
+  const auto &p = pattern();
+  if (p.empty() || p[0] != separator) { return false; }
+
+  segments.clear();
+  size_t pos = 1;
+  while (true) {
+    auto end = p.find(separator, pos);
+    if (end == std::string::npos) {
+      segments.push_back(p.substr(pos));
+      break;
+    }
+    segments.push_back(p.substr(pos, end - pos));
+    pos = end + 1;
+  }
+
+  // A slash right after a parameter ends its capture and is not matched
+  // against the path, so "/users/:id/" behaves like "/users/:id".
+  if (segments.size() >= 2 && segments.back().empty() &&
+      segments[segments.size() - 2][0] == ':') {
+    segments.pop_back();
+  }
+  return true;
+}
+
+inline RegexMatcher::RegexMatcher(const std::string &pattern)
+    : MatcherBase(pattern), regex_(pattern) {
+  literal_ = pattern.find_first_of(".[]{}()*+?^$|\\") == std::string::npos;
+}
+
 inline bool RegexMatcher::match(Request &request) const {
   request.path_params.clear();
+  if (literal_) {
+    request.matches = std::smatch();
+    return request.path == pattern();
+  }
   return std::regex_match(request.path, request.matches, regex_);
 }
 
+inline bool RegexMatcher::route_segments(
+    std::vector<std::string> &segments) const {
+  const auto &p = pattern();
+  if (!literal_ || p.empty() || p[0] != '/') { return false; }
+
+  segments.clear();
+  size_t pos = 1;
+  while (true) {
+    auto end = p.find('/', pos);
+    if (end == std::string::npos) {
+      segments.push_back(p.substr(pos));
+      break;
+    }
+    segments.push_back(p.substr(pos, end - pos));
+    pos = end + 1;
+  }
+
+  // Literal segments never act as parameters.
+  for (const auto &segment : segments) {
+    if (!segment.empty() && segment[0] == ':') { return false; }
+  }
+  return true;
+}
+
+inline void RouteTable::build(const std::vector<const MatcherBase *> &matchers) {
+  matchers_ = matchers;
+  root_.children.clear();
+  root_.param.reset();
+  root_.routes.clear();
+  fallback_.clear();
+
+  std::vector<std::string> segments;
+  for (size_t i = 0; i < matchers_.size(); i++) {
+    if (!matchers_[i]->route_segments(segments)) {
+      fallback_.push_back(i);
+      continue;
+    }
+
+    auto node = &root_;
+    for (const auto &segment : segments) {
+      auto &next = (!segment.empty() && segment[0] == ':')
+                       ? node->param
+                       : node->children[segment];
+      if (!next) { next.reset(new Node()); }
+      node = next.get();
+    }
+    node->routes.push_back(i);
+  }
+}
+
+inline void RouteTable::collect(const Node &node, const std::string &path,
+                                size_t pos, std::vector<size_t> &out) const {
+  // A trailing slash after the last segment is accepted by path-parameter
+  // routes, so the node is a candidate as well.
+  if (pos == path.size()) {
+    out.insert(out.end(), node.routes.begin(), node.routes.end());
+  }
+
+  auto end = path.find('/', pos);
+  auto last = end == std::string::npos;
+  if (last) { end = path.size(); }
+
+  if (!node.children.empty()) {
+    auto it = node.children.find(path.substr(pos, end - pos));
+    if (it != node.children.end()) {
+      if (last) {
+        out.insert(out.end(), it->second->routes.begin(),
+                   it->second->routes.end());
+      } else {
+        collect(*it->second, path, end + 1, out);
+      }
+    }
+  }
+
+  if (node.param) {
+    if (last) {
+      out.insert(out.end(), node.param->routes.begin(),
+                 node.param->routes.end());
+    } else {
+      collect(*node.param, path, end + 1, out);
+    }
+  }
+}
+
+inline int RouteTable::find(Request &request) const {
+  std::vector<size_t> candidates;
+  const auto &path = request.path;
+  if (!path.empty() && path[0] == '/') {
+    collect(root_, path, 1, candidates);
+    std::sort(candidates.begin(), candidates.end());
+  }
+
+  // Walk both lists in registration order.
+  size_t i = 0;
+  size_t j = 0;
+  while (i < candidates.size() || j < fallback_.size()) {
+    size_t index;
+    if (j == fallback_.size() ||
+        (i < candidates.size() && candidates[i] < fallback_[j])) {
+      index = candidates[i++];
+    } else {
+      index = fallback_[j++];
+    }
+    if (matchers_[index]->match(request)) { return static_cast<int>(index); }
+  }
+  return -1;
+}
+
 // Enclose IPv6 address in brackets if needed
 inline std::string prepare_host_string(const std::string &host) {
   // Enclose IPv6 address in brackets (but not if already enclosed)
@@ -10578,6 +11600,31 @@ inline Server &Server::set_keep_alive_timeout(time_t sec) {
   return *this;
 }
 
+inline Server &Server::set_keep_alive_reactor(bool on) {
+  keep_alive_reactor_ = on;
+  return *this;
+}
+
+inline Server &Server::set_compression_threshold(size_t bytes) {
+  compression_threshold_ = bytes;
+  return *this;
+}
+
+inline Server &Server::set_compression_level(int level) {
+  compression_level_ = level;
+  return *this;
+}
+
+inline Server &Server::set_listener_count(size_t count) {
+  listener_count_ = count > 0 ? count : 1;
+  return *this;
+}
+
+inline Server &Server::set_listen_backlog(int backlog) {
+  listen_backlog_ = backlog;
+  return *this;
+}
+
 inline Server &Server::set_read_timeout(time_t sec, time_t usec) {
   read_timeout_sec_ = sec;
   read_timeout_usec_ = usec;
@@ -10613,8 +11660,40 @@ inline int Server::bind_to_any_port(const std::string &host, int socket_flags) {
   return ret;
 }
 
+inline bool Server::adopt_listen_sockets(const std::vector<socket_t> &socks) {
+  if (is_decommissioned || socks.empty()) { return false; }
+  close_extra_listeners();
+  svr_sock_ = socks[0];
+  for (size_t i = 1; i < socks.size(); i++) {
+    extra_svr_socks_.emplace_back(new std::atomic<socket_t>(socks[i]));
+  }
+  return true;
+}
+
 inline bool Server::listen_after_bind() { return listen_internal(); }
 
+inline std::vector<socket_t> Server::listen_sockets() const {
+  std::vector<socket_t> socks;
+  if (svr_sock_ != INVALID_SOCKET) { socks.push_back(svr_sock_); }
+  for (auto &extra : extra_svr_socks_) {
+    socket_t sock = *extra;
+    if (sock != INVALID_SOCKET) { socks.push_back(sock); }
+  }
+  return socks;
+}
+
+inline void Server::release_listen_sockets() {
+  // Closing here could hand the descriptor number to the next accept() or
+  // pipe() while a loop is still selecting on it.
+  std::lock_guard<std::mutex> guard(released_socks_mutex_);
+  auto sock = svr_sock_.exchange(INVALID_SOCKET);
+  if (sock != INVALID_SOCKET) { released_socks_.push_back(sock); }
+  for (auto &extra : extra_svr_socks_) {
+    auto s = extra->exchange(INVALID_SOCKET);
+    if (s != INVALID_SOCKET) { released_socks_.push_back(s); }
+  }
+}
+
 inline bool Server::listen(const std::string &host, int port,
                            int socket_flags) {
   return bind_to_port(host, port, socket_flags) && listen_internal();
@@ -10634,6 +11713,16 @@ inline void Server::stop() {
     std::atomic<socket_t> sock(svr_sock_.exchange(INVALID_SOCKET));
     detail::shutdown_socket(sock);
     detail::close_socket(sock);
+    // The shard loops may still be polling these; listen_internal() closes
+    // them once it has joined the shards.
+    std::lock_guard<std::mutex> guard(released_socks_mutex_);
+    for (auto &extra : extra_svr_socks_) {
+      auto s = extra->exchange(INVALID_SOCKET);
+      if (s != INVALID_SOCKET) {
+        detail::shutdown_socket(s);
+        released_socks_.push_back(s);
+      }
+    }
   }
   is_decommissioned = false;
 }
@@ -10812,23 +11901,12 @@ Server::write_content_with_provider(Stream &strm, const Request &req,
     if (res.is_chunked_content_provider_) {
       auto type = detail::encoding_type(req, res);
 
-      std::unique_ptr<detail::compressor> compressor;
-      if (type == detail::EncodingType::Gzip) {
-#ifdef CPPHTTPLIB_ZLIB_SUPPORT
-        compressor = detail::make_unique<detail::gzip_compressor>();
-#endif
-      } else if (type == detail::EncodingType::Brotli) {
-#ifdef CPPHTTPLIB_BROTLI_SUPPORT
-        compressor = detail::make_unique<detail::brotli_compressor>();
-#endif
-      } else if (type == detail::EncodingType::Zstd) {
-#ifdef CPPHTTPLIB_ZSTD_SUPPORT
-        compressor = detail::make_unique<detail::zstd_compressor>();
-#endif
-      } else {
+      std::string content_encoding;
+      auto compressor =
+          detail::make_compressor(type, compression_level_, content_encoding);
+      if (!compressor) {
         compressor = detail::make_unique<detail::nocompressor>();
       }
-      assert(compressor != nullptr);
 
       return detail::write_content_chunked(strm, res.content_provider_,
                                            is_shutting_down, *compressor);
@@ -11057,7 +12135,7 @@ inline bool Server::handle_file_request(Request &req, Response &res) {
               detail::find_content_type(path, file_extension_and_mimetype_map_,
                                         default_file_mimetype_),
               [mm](size_t offset, size_t length, DataSink &sink) -> bool {
-                sink.write(mm->data() + offset, length);
+                detail::write_mapped_file(*mm, offset, length, sink);
                 return true;
               });
 
@@ -11162,7 +12240,7 @@ Server::create_server_socket(const std::string &host, int port,
           output_error_log(Error::BindIPAddress, nullptr);
           return false;
         }
-        if (::listen(sock, CPPHTTPLIB_LISTEN_BACKLOG)) {
+        if (::listen(sock, listen_backlog_)) {
           output_error_log(Error::Listen, nullptr);
           return false;
         }
@@ -11188,88 +12266,179 @@ inline int Server::bind_internal(const std::string &host, int port,
       return -1;
     }
     if (addr.ss_family == AF_INET) {
-      return ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
+      port = ntohs(reinterpret_cast<struct sockaddr_in *>(&addr)->sin_port);
     } else if (addr.ss_family == AF_INET6) {
-      return ntohs(reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_port);
+      port = ntohs(reinterpret_cast<struct sockaddr_in6 *>(&addr)->sin6_port);
     } else {
       output_error_log(Error::UnsupportedAddressFamily, nullptr);
       return -1;
     }
-  } else {
-    return port;
   }
+
+  // The extra listeners only bind if the socket options allow port sharing;
+  // if one fails the server keeps serving on the sockets it already has.
+  close_extra_listeners();
+  for (size_t i = 1; i < listener_count_; i++) {
+    auto sock = create_server_socket(host, port, socket_flags, socket_options_);
+    if (sock == INVALID_SOCKET) { break; }
+    extra_svr_socks_.emplace_back(new std::atomic<socket_t>(sock));
+  }
+
+  return port;
+}
+
+inline void Server::close_extra_listeners() {
+  for (auto &extra : extra_svr_socks_) {
+    auto sock = extra->exchange(INVALID_SOCKET);
+    if (sock != INVALID_SOCKET) { detail::close_socket(sock); }
+  }
+  extra_svr_socks_.clear();
 }
 
 inline bool Server::listen_internal() {
   if (is_decommissioned) { return false; }
 
+  build_route_tables();
+
   auto ret = true;
   is_running_ = true;
   auto se = detail::scope_exit([&]() { is_running_ = false; });
 
   {
-    std::unique_ptr<TaskQueue> task_queue(new_task_queue());
+    // Each extra listener gets its own accept loop and task queue, so a
+    // connection is accepted and served without crossing to another shard.
+    std::vector<std::thread> shards;
+    for (auto &extra : extra_svr_socks_) {
+      auto sock = extra.get();
+      shards.emplace_back([this, sock]() { accept_loop(*sock); });
+    }
+
+    ret = accept_loop(svr_sock_);
+
+    // Shut the extra listeners down to wake their loops, but close them only
+    // after the joins so a shard never polls a reused descriptor number.
+    {
+      std::lock_guard<std::mutex> guard(released_socks_mutex_);
+      for (auto &extra : extra_svr_socks_) {
+        auto sock = extra->exchange(INVALID_SOCKET);
+        if (sock != INVALID_SOCKET) {
+          detail::shutdown_socket(sock);
+          released_socks_.push_back(sock);
+        }
+      }
+    }
+    for (auto &t : shards) {
+      t.join();
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(released_socks_mutex_);
+    extra_svr_socks_.clear();
+    for (auto sock : released_socks_) {
+      detail::close_socket(sock);
+    }
+    released_socks_.clear();
+  }
 
-    while (svr_sock_ != INVALID_SOCKET) {
-#ifndef _WIN32
-      if (idle_interval_sec_ > 0 || idle_interval_usec_ > 0) {
+  is_decommissioned = !ret;
+  return ret;
+}
+
+inline bool Server::accept_loop(std::atomic<socket_t> &svr_sock) {
+  auto ret = true;
+  std::unique_ptr<TaskQueue> task_queue(new_task_queue());
+
+#ifdef __linux__
+  std::unique_ptr<detail::KeepAliveReactor> reactor;
+  if (keep_alive_reactor_ && supports_keep_alive_reactor()) {
+    auto q = task_queue.get();
+    reactor.reset(new detail::KeepAliveReactor(
+        keep_alive_timeout_sec_, [this, q, &reactor](socket_t sock,
+                                                     size_t remaining) {
+          auto r = reactor.get();
+          return q->enqueue([this, sock, remaining, r]() {
+            process_reactor_socket(sock, remaining, *r);
+          });
+        }));
+    if (!reactor->is_valid()) { reactor.reset(); }
+  }
 #endif
-        auto val = detail::select_read(svr_sock_, idle_interval_sec_,
-                                       idle_interval_usec_);
-        if (val == 0) { // Timeout
-          task_queue->on_idle();
-          continue;
-        }
+
+  while (svr_sock != INVALID_SOCKET) {
 #ifndef _WIN32
+    if (idle_interval_sec_ > 0 || idle_interval_usec_ > 0) {
+#endif
+      auto val = detail::select_read(svr_sock, idle_interval_sec_,
+                                     idle_interval_usec_);
+      if (val == 0) { // Timeout
+        task_queue->on_idle();
+        continue;
       }
+#ifndef _WIN32
+    }
 #endif
 
 #if defined _WIN32
-      // sockets connected via WASAccept inherit flags NO_HANDLE_INHERIT,
-      // OVERLAPPED
-      socket_t sock = WSAAccept(svr_sock_, nullptr, nullptr, nullptr, 0);
+    // sockets connected via WASAccept inherit flags NO_HANDLE_INHERIT,
+    // OVERLAPPED
+    socket_t sock = WSAAccept(svr_sock, nullptr, nullptr, nullptr, 0);
 #elif defined SOCK_CLOEXEC
-      socket_t sock = accept4(svr_sock_, nullptr, nullptr, SOCK_CLOEXEC);
+    socket_t sock = accept4(svr_sock, nullptr, nullptr, SOCK_CLOEXEC);
 #else
-      socket_t sock = accept(svr_sock_, nullptr, nullptr);
+    socket_t sock = accept(svr_sock, nullptr, nullptr);
 #endif
 
-      if (sock == INVALID_SOCKET) {
-        if (errno == EMFILE) {
-          // The per-process limit of open file descriptors has been reached.
-          // Try to accept new connections after a short sleep.
-          std::this_thread::sleep_for(std::chrono::microseconds{1});
-          continue;
-        } else if (errno == EINTR || errno == EAGAIN) {
-          continue;
-        }
-        if (svr_sock_ != INVALID_SOCKET) {
-          detail::close_socket(svr_sock_);
-          ret = false;
-          output_error_log(Error::Connection, nullptr);
-        } else {
-          ; // The server socket was closed by user.
-        }
-        break;
+    if (sock == INVALID_SOCKET) {
+      if (errno == EMFILE) {
+        // The per-process limit of open file descriptors has been reached.
+        // Try to accept new connections after a short sleep.
+        std::this_thread::sleep_for(std::chrono::microseconds{1});
+        continue;
+      } else if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      auto listening = svr_sock.exchange(INVALID_SOCKET);
+      if (listening != INVALID_SOCKET) {
+        detail::close_socket(listening);
+        ret = false;
+        output_error_log(Error::Connection, nullptr);
+      } else {
+        ; // The server socket was closed by user.
       }
+      break;
+    }
 
-      detail::set_socket_opt_time(sock, SOL_SOCKET, SO_RCVTIMEO,
-                                  read_timeout_sec_, read_timeout_usec_);
-      detail::set_socket_opt_time(sock, SOL_SOCKET, SO_SNDTIMEO,
-                                  write_timeout_sec_, write_timeout_usec_);
+    detail::set_socket_opt_time(sock, SOL_SOCKET, SO_RCVTIMEO,
+                                read_timeout_sec_, read_timeout_usec_);
+    detail::set_socket_opt_time(sock, SOL_SOCKET, SO_SNDTIMEO,
+                                write_timeout_sec_, write_timeout_usec_);
 
-      if (!task_queue->enqueue(
-              [this, sock]() { process_and_close_socket(sock); })) {
-        output_error_log(Error::ResourceExhaustion, nullptr);
+#ifdef __linux__
+    if (reactor) {
+      if (!reactor->park(sock, keep_alive_max_count_)) {
         detail::shutdown_socket(sock);
         detail::close_socket(sock);
       }
+      continue;
     }
+#endif
 
-    task_queue->shutdown();
+    if (!task_queue->enqueue(
+            [this, sock]() { process_and_close_socket(sock); })) {
+      output_error_log(Error::ResourceExhaustion, nullptr);
+      detail::shutdown_socket(sock);
+      detail::close_socket(sock);
+    }
   }
 
-  is_decommissioned = !ret;
+#ifdef __linux__
+  // Stop handing out connections before the workers are joined; workers
+  // that try to park afterwards close their connection instead.
+  if (reactor) { reactor->stop(); }
+#endif
+  task_queue->shutdown();
+
   return ret;
 }
 
@@ -11306,25 +12475,29 @@ inline bool Server::routing(Request &req, Response &res, Stream &strm) {
       if (req.method == "POST") {
         if (dispatch_request_for_content_reader(
                 req, res, std::move(reader),
-                post_handlers_for_content_reader_)) {
+                post_handlers_for_content_reader_,
+                post_routes_for_content_reader_)) {
           return true;
         }
       } else if (req.method == "PUT") {
         if (dispatch_request_for_content_reader(
                 req, res, std::move(reader),
-                put_handlers_for_content_reader_)) {
+                put_handlers_for_content_reader_,
+                put_routes_for_content_reader_)) {
           return true;
         }
       } else if (req.method == "PATCH") {
         if (dispatch_request_for_content_reader(
                 req, res, std::move(reader),
-                patch_handlers_for_content_reader_)) {
+                patch_handlers_for_content_reader_,
+                patch_routes_for_content_reader_)) {
           return true;
         }
       } else if (req.method == "DELETE") {
         if (dispatch_request_for_content_reader(
                 req, res, std::move(reader),
-                delete_handlers_for_content_reader_)) {
+                delete_handlers_for_content_reader_,
+                delete_routes_for_content_reader_)) {
           return true;
         }
       }
@@ -11339,17 +12512,17 @@ inline bool Server::routing(Request &req, Response &res, Stream &strm) {
 
   // Regular handler
   if (req.method == "GET" || req.method == "HEAD") {
-    return dispatch_request(req, res, get_handlers_);
+    return dispatch_request(req, res, get_handlers_, get_routes_);
   } else if (req.method == "POST") {
-    return dispatch_request(req, res, post_handlers_);
+    return dispatch_request(req, res, post_handlers_, post_routes_);
   } else if (req.method == "PUT") {
-    return dispatch_request(req, res, put_handlers_);
+    return dispatch_request(req, res, put_handlers_, put_routes_);
   } else if (req.method == "DELETE") {
-    return dispatch_request(req, res, delete_handlers_);
+    return dispatch_request(req, res, delete_handlers_, delete_routes_);
   } else if (req.method == "OPTIONS") {
-    return dispatch_request(req, res, options_handlers_);
+    return dispatch_request(req, res, options_handlers_, options_routes_);
   } else if (req.method == "PATCH") {
-    return dispatch_request(req, res, patch_handlers_);
+    return dispatch_request(req, res, patch_handlers_, patch_routes_);
   }
 
   res.status = StatusCode::BadRequest_400;
@@ -11357,7 +12530,21 @@ inline bool Server::routing(Request &req, Response &res, Stream &strm) {
 }
 
 inline bool Server::dispatch_request(Request &req, Response &res,
-                                     const Handlers &handlers) const {
+                                     const Handlers &handlers,
+                                     const detail::RouteTable &routes) const {
+  if (routes.size() == handlers.size()) {
+    auto index = routes.find(req);
+    if (index < 0) { return false; }
+
+    const auto &x = handlers[static_cast<size_t>(index)];
+    req.matched_route = x.first->pattern();
+    if (!pre_request_handler_ ||
+        pre_request_handler_(req, res) != HandlerResponse::Handled) {
+      x.second(req, res);
+    }
+    return true;
+  }
+
   for (const auto &x : handlers) {
     const auto &matcher = x.first;
     const auto &handler = x.second;
@@ -11374,6 +12561,39 @@ inline bool Server::dispatch_request(Request &req, Response &res,
   return false;
 }
 
+inline void Server::build_route_tables() {
+  auto build = [](detail::RouteTable &table, const Handlers &handlers) {
+    std::vector<const detail::MatcherBase *> matchers;
+    for (const auto &x : handlers) {
+      matchers.push_back(x.first.get());
+    }
+    table.build(matchers);
+  };
+  auto build_for_content_reader = [](detail::RouteTable &table,
+                                     const HandlersForContentReader &handlers) {
+    std::vector<const detail::MatcherBase *> matchers;
+    for (const auto &x : handlers) {
+      matchers.push_back(x.first.get());
+    }
+    table.build(matchers);
+  };
+
+  build(get_routes_, get_handlers_);
+  build(post_routes_, post_handlers_);
+  build_for_content_reader(post_routes_for_content_reader_,
+                           post_handlers_for_content_reader_);
+  build(put_routes_, put_handlers_);
+  build_for_content_reader(put_routes_for_content_reader_,
+                           put_handlers_for_content_reader_);
+  build(patch_routes_, patch_handlers_);
+  build_for_content_reader(patch_routes_for_content_reader_,
+                           patch_handlers_for_content_reader_);
+  build(delete_routes_, delete_handlers_);
+  build_for_content_reader(delete_routes_for_content_reader_,
+                           delete_handlers_for_content_reader_);
+  build(options_routes_, options_handlers_);
+}
+
 inline void Server::apply_ranges(const Request &req, Response &res,
                                  std::string &content_type,
                                  std::string &boundary) const {
@@ -11450,28 +12670,15 @@ inline void Server::apply_ranges(const Request &req, Response &res,
       res.body.swap(data);
     }
 
-    if (type != detail::EncodingType::None) {
+    // Small bodies go out as they are; compressing them costs more CPU than
+    // the bytes it saves.
+    if (type != detail::EncodingType::None &&
+        res.body.size() >= compression_threshold_) {
       output_pre_compression_log(req, res);
 
-      std::unique_ptr<detail::compressor> compressor;
       std::string content_encoding;
-
-      if (type == detail::EncodingType::Gzip) {
-#ifdef CPPHTTPLIB_ZLIB_SUPPORT
-        compressor = detail::make_unique<detail::gzip_compressor>();
-        content_encoding = "gzip";
-#endif
-      } else if (type == detail::EncodingType::Brotli) {
-#ifdef CPPHTTPLIB_BROTLI_SUPPORT
-        compressor = detail::make_unique<detail::brotli_compressor>();
-        content_encoding = "br";
-#endif
-      } else if (type == detail::EncodingType::Zstd) {
-#ifdef CPPHTTPLIB_ZSTD_SUPPORT
-        compressor = detail::make_unique<detail::zstd_compressor>();
-        content_encoding = "zstd";
-#endif
-      }
+      auto compressor =
+          detail::make_compressor(type, compression_level_, content_encoding);
 
       if (compressor) {
         std::string compressed;
@@ -11494,7 +12701,21 @@ inline void Server::apply_ranges(const Request &req, Response &res,
 
 inline bool Server::dispatch_request_for_content_reader(
     Request &req, Response &res, ContentReader content_reader,
-    const HandlersForContentReader &handlers) const {
+    const HandlersForContentReader &handlers,
+    const detail::RouteTable &routes) const {
+  if (routes.size() == handlers.size()) {
+    auto index = routes.find(req);
+    if (index < 0) { return false; }
+
+    const auto &x = handlers[static_cast<size_t>(index)];
+    req.matched_route = x.first->pattern();
+    if (!pre_request_handler_ ||
+        pre_request_handler_(req, res) != HandlerResponse::Handled) {
+      x.second(req, res, content_reader);
+    }
+    return true;
+  }
+
   for (const auto &x : handlers) {
     const auto &matcher = x.first;
     const auto &handler = x.second;
@@ -11568,7 +12789,10 @@ Server::process_request(Stream &strm, const std::string &remote_addr,
 
   Response res;
   res.version = "HTTP/1.1";
-  res.headers = default_headers_;
+
+  auto &recycler = detail::request_recycler();
+  recycler.acquire(req, res, default_headers_);
+  auto se = detail::scope_exit([&]() { recycler.release(req, res); });
 
   // Request line and headers
   if (!parse_request_line(line_reader.ptr(), req)) {
@@ -11578,7 +12802,7 @@ Server::process_request(Stream &strm, const std::string &remote_addr,
   }
 
   // Request headers
-  if (!detail::read_headers(strm, req.headers)) {
+  if (!detail::read_headers(strm, req.headers, &recycler)) {
     res.status = StatusCode::BadRequest_400;
     output_error_log(Error::InvalidHeaders, &req);
     return write_response(strm, close_connection, req, res);
@@ -11789,7 +13013,7 @@ Server::process_request(Stream &strm, const std::string &remote_addr,
       res.set_content_provider(
           mm->size(), content_type,
           [mm](size_t offset, size_t length, DataSink &sink) -> bool {
-            sink.write(mm->data() + offset, length);
+            detail::write_mapped_file(*mm, offset, length, sink);
             return true;
           });
     }
@@ -11837,6 +13061,49 @@ inline bool Server::process_and_close_socket(socket_t sock) {
   return ret;
 }
 
+inline void Server::process_reactor_socket(socket_t sock, size_t remaining,
+                                           detail::KeepAliveReactor &reactor) {
+#ifdef __linux__
+  std::string remote_addr;
+  int remote_port = 0;
+  detail::get_remote_ip_and_port(sock, remote_addr, remote_port);
+
+  std::string local_addr;
+  int local_port = 0;
+  detail::get_local_ip_and_port(sock, local_addr, local_port);
+
+  // Kept across requests so pipelined requests it has buffered survive.
+  detail::SocketStream strm(sock, read_timeout_sec_, read_timeout_usec_,
+                            write_timeout_sec_, write_timeout_usec_);
+  while (remaining > 0) {
+    auto close_connection = remaining == 1;
+    auto connection_closed = false;
+    bool websocket_upgraded = false;
+    auto ret = process_request(strm, remote_addr, remote_port, local_addr,
+                               local_port, close_connection, connection_closed,
+                               nullptr, &websocket_upgraded);
+    remaining--;
+    if (!ret || connection_closed || websocket_upgraded || remaining == 0 ||
+        svr_sock_ == INVALID_SOCKET) {
+      break;
+    }
+
+    // Serve a request that is already waiting, buffered or on the socket;
+    // otherwise give the thread back and let the reactor wait for the next
+    // one. Only an empty buffer can be parked, since the stream goes away.
+    if (strm.is_readable() || detail::select_read(sock, 0, 0) > 0) { continue; }
+    if (reactor.park(sock, remaining)) { return; }
+    break;
+  }
+#else
+  (void)remaining;
+  (void)reactor;
+#endif
+
+  detail::shutdown_socket(sock);
+  detail::close_socket(sock);
+}
+
 inline void Server::output_log(const Request &req, const Response &res) const {
   if (logger_) {
     std::lock_guard<std::mutex> guard(logger_mutex_);
@@ -1,44 +1,506 @@
 // server.cpp
 #include <algorithm>
+#include <array>
 #include <cctype>
+#include <charconv>
+#include <cmath>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <fcntl.h>
+#include <poll.h>
 #include <regex>
+#include <spawn.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <random>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <csignal>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <future>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <list>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "httplib.h"
 
+extern char **environ;
+
+// What a command used, read back from its cgroup (CMD_SERVICE_CGROUP_ROOT).
+struct ResourceUsage {
+  bool measured = false;
+  uint64_t cpu_usec = 0;
+  uint64_t user_usec = 0;
+  uint64_t system_usec = 0;
+  uint64_t memory_peak_bytes = 0;  // 0 on kernels without memory.peak
+  uint64_t io_read_bytes = 0;
+  uint64_t io_write_bytes = 0;
+};
+
 struct ExecResult {
   bool ok;
   int exit_code;
   bool timed_out;
   std::string output;
   std::string error;
+  bool truncated = false;
+  size_t output_bytes = 0;  // total bytes the command printed, kept or not
+  // With RunOptions::split_stderr, `output` is stdout alone and stderr is here.
+  bool split_stderr = false;
+  std::string stderr_output{};
+  bool stderr_truncated = false;
+  size_t stderr_bytes = 0;
+  ResourceUsage usage{};
+  double spawn_seconds = 0;  // launching the child; 0 when a shell worker ran it
 };
 
-std::string json_escape(const std::string &s) {
-  std::string out;
-  out.reserve(s.size() + 16);
-  for (char c : s) {
-    switch (c) {
-      case '\"': out += "\\\""; break;
-      case '\\': out += "\\\\"; break;
-      case '\n': out += "\\n"; break;
-      case '\r': out += "\\r"; break;
-      case '\t': out += "\\t"; break;
-      default: out += c; break;
+// Receives the child's output pipe with `available` bytes ready to read, and
+// must consume exactly those bytes. Returning false stops the command.
+using PipeHandler = std::function<bool(int fd, size_t available)>;
+
+// Receives output as it is read from the child. Returning false stops the
+// command (e.g. the client went away).
+using OutputHandler = std::function<bool(const char *data, size_t len)>;
+
+struct RunOptions {
+  int timeout_sec = 20;
+  // When set, the command is also stopped here, even if that comes before
+  // timeout_sec runs out (a batch shares one deadline between its commands).
+  std::chrono::steady_clock::time_point deadline{};
+  size_t output_cap = 0;  // 0: use ServiceConfig::output_cap
+  // Capture stderr on a pipe of its own, capped separately (0: use
+  // ServiceConfig::stderr_cap) or handed to on_stderr as it is read, instead
+  // of interleaved with stdout. Bypasses the shell worker pool.
+  bool split_stderr = false;
+  size_t stderr_cap = 0;
+  OutputHandler on_stderr;
+  // When set, output is handed over in the pipe instead of being read (so it
+  // can be spliced to a socket); bytes that are read anyway still go to the
+  // OutputHandler. Bypasses the shell worker pool, whose pipe is shared.
+  PipeHandler on_pipe;
+};
+
+enum class Launcher { PosixSpawn, Fork };
+
+// Login runs `shell -lc` (profile scripts every time), Plain runs `shell -c`,
+// and Snapshot runs `shell -c` with the environment a login shell produced
+// once at startup.
+enum class ShellMode { Login, Plain, Snapshot };
+
+struct ServiceConfig {
+  Launcher launcher = Launcher::PosixSpawn;
+  std::string shell = "/bin/bash";
+  ShellMode shell_mode = ShellMode::Login;
+  bool direct_exec = false;
+  size_t shell_workers = 0;
+  size_t shell_workers_max = 0;
+  size_t worker_max_commands = 1000;
+  int shell_worker_idle_sec = 30;  // before a worker above shell_workers is retired
+  size_t job_workers = 4;
+  size_t job_queue_max = 1024;
+  int job_retention_sec = 600;
+  size_t batch_parallel = 8;
+  size_t batch_max_commands = 1000;
+  size_t max_children = 0;  // 0: no admission control
+  size_t admission_queue = 64;
+  int admission_queue_ms = 1000;
+  bool admission_adaptive = false;
+  size_t output_cap = 4 << 20;
+  size_t output_tail = 256 << 10;
+  size_t stderr_cap = 1 << 20;
+  bool split_stderr = false;  // the default for requests without ?stderr=
+  size_t cache_bytes = 16 << 20;
+  bool keep_alive_reactor = false;
+  bool work_stealing_pool = false;
+  size_t http_threads = 0;  // 0: CPPHTTPLIB_THREAD_POOL_COUNT
+  bool pin_http_threads = false;
+  size_t listeners = 1;
+  int listen_backlog = 1024;
+  std::string static_dir;
+  std::string static_mount = "/files/";
+  size_t compression_min_bytes = 1024;
+  int compression_level = -1;  // codec default
+  // A delegated cgroup v2 directory; when set, every command runs in a child
+  // cgroup of its own with these limits (cgroup v2 syntax, empty: no limit).
+  std::string cgroup_root;
+  std::string cgroup_cpu_max;
+  std::string cgroup_memory_max;
+  std::string cgroup_pids_max;
+  // JSON lines access log (empty: none), rotated when it reaches
+  // access_log_max_bytes (0: never) with access_log_keep old files.
+  std::string access_log;
+  size_t access_log_buffer = 8192;  // records; a power of two
+  size_t access_log_max_bytes = 64 << 20;
+  size_t access_log_keep = 5;
+  // Unix socket a restarted process takes the listening sockets over on.
+  std::string handoff_socket;
+  int drain_sec = 30;
+};
+
+ServiceConfig g_config;
+
+std::string env_or(const char *name, const std::string &fallback) {
+  const char *value = std::getenv(name);
+  return (value && *value) ? std::string(value) : fallback;
+}
+
+size_t env_size_or(const char *name, size_t fallback) {
+  const char *value = std::getenv(name);
+  if (!value || !*value) return fallback;
+  char *end = nullptr;
+  unsigned long long n = std::strtoull(value, &end, 10);
+  if (*end != '\0') {
+    std::cerr << "invalid " << name << " '" << value << "', using " << fallback << "\n";
+    return fallback;
+  }
+  return static_cast<size_t>(n);
+}
+
+void load_config_from_env() {
+  const std::string launcher = env_or("CMD_SERVICE_LAUNCHER", "posix_spawn");
+  if (launcher == "fork") {
+    g_config.launcher = Launcher::Fork;
+  } else if (launcher == "posix_spawn") {
+    g_config.launcher = Launcher::PosixSpawn;
+  } else {
+    std::cerr << "unknown CMD_SERVICE_LAUNCHER '" << launcher << "', using posix_spawn\n";
+  }
+
+  g_config.shell = env_or("CMD_SERVICE_SHELL", "/bin/bash");
+  const std::string shell_mode = env_or("CMD_SERVICE_SHELL_MODE", "login");
+  if (shell_mode == "plain") {
+    g_config.shell_mode = ShellMode::Plain;
+  } else if (shell_mode == "snapshot") {
+    g_config.shell_mode = ShellMode::Snapshot;
+  } else if (shell_mode != "login") {
+    std::cerr << "unknown CMD_SERVICE_SHELL_MODE '" << shell_mode << "', using login\n";
+  }
+  g_config.direct_exec = env_or("CMD_SERVICE_DIRECT_EXEC", "0") == "1";
+  g_config.shell_workers = env_size_or("CMD_SERVICE_SHELL_WORKERS", 0);
+  g_config.shell_workers_max = std::max(
+      g_config.shell_workers,
+      env_size_or("CMD_SERVICE_SHELL_WORKERS_MAX", g_config.shell_workers * 4));
+  g_config.worker_max_commands =
+      std::max<size_t>(1, env_size_or("CMD_SERVICE_WORKER_MAX_COMMANDS", 1000));
+  g_config.shell_worker_idle_sec = static_cast<int>(
+      std::max<size_t>(1, env_size_or("CMD_SERVICE_SHELL_WORKER_IDLE_SEC", 30)));
+
+  g_config.job_workers = std::max<size_t>(1, env_size_or("CMD_SERVICE_JOB_WORKERS", 4));
+  g_config.job_queue_max = env_size_or("CMD_SERVICE_JOB_QUEUE_MAX", 1024);
+  g_config.job_retention_sec =
+      static_cast<int>(env_size_or("CMD_SERVICE_JOB_RETENTION_SEC", 600));
+  g_config.batch_parallel = std::max<size_t>(1, env_size_or("CMD_SERVICE_BATCH_PARALLEL", 8));
+  g_config.batch_max_commands = env_size_or("CMD_SERVICE_BATCH_MAX_COMMANDS", 1000);
+  g_config.max_children = env_size_or("CMD_SERVICE_MAX_CHILDREN", 0);
+  g_config.admission_queue = env_size_or("CMD_SERVICE_ADMISSION_QUEUE", 64);
+  g_config.admission_queue_ms =
+      static_cast<int>(env_size_or("CMD_SERVICE_ADMISSION_QUEUE_MS", 1000));
+  g_config.admission_adaptive = env_or("CMD_SERVICE_ADMISSION_ADAPTIVE", "0") == "1";
+  g_config.output_cap = std::max<size_t>(1, env_size_or("CMD_SERVICE_OUTPUT_CAP", 4 << 20));
+  g_config.output_tail = env_size_or("CMD_SERVICE_OUTPUT_TAIL", 256 << 10);
+  g_config.stderr_cap = std::max<size_t>(1, env_size_or("CMD_SERVICE_STDERR_CAP", 1 << 20));
+  const std::string stderr_mode = env_or("CMD_SERVICE_STDERR", "combined");
+  if (stderr_mode == "separate") {
+    g_config.split_stderr = true;
+  } else if (stderr_mode != "combined") {
+    std::cerr << "unknown CMD_SERVICE_STDERR '" << stderr_mode << "', using combined\n";
+  }
+  g_config.cache_bytes = env_size_or("CMD_SERVICE_CACHE_BYTES", 16 << 20);
+  g_config.keep_alive_reactor = env_or("CMD_SERVICE_KEEPALIVE_REACTOR", "0") == "1";
+  const std::string http_pool = env_or("CMD_SERVICE_HTTP_POOL", "thread_pool");
+  if (http_pool == "work_stealing") {
+    g_config.work_stealing_pool = true;
+  } else if (http_pool != "thread_pool") {
+    std::cerr << "unknown CMD_SERVICE_HTTP_POOL '" << http_pool << "', using thread_pool\n";
+  }
+  g_config.http_threads = env_size_or("CMD_SERVICE_HTTP_THREADS", 0);
+  g_config.pin_http_threads = env_or("CMD_SERVICE_PIN_HTTP_THREADS", "0") == "1";
+  g_config.listeners = std::max<size_t>(1, env_size_or("CMD_SERVICE_LISTENERS", 1));
+  g_config.listen_backlog = static_cast<int>(env_size_or("CMD_SERVICE_LISTEN_BACKLOG", 1024));
+  g_config.static_dir = env_or("CMD_SERVICE_STATIC_DIR", "");
+  g_config.static_mount = env_or("CMD_SERVICE_STATIC_MOUNT", "/files/");
+  if (g_config.static_mount.back() != '/') g_config.static_mount += '/';
+  g_config.compression_min_bytes = env_size_or("CMD_SERVICE_COMPRESSION_MIN_BYTES", 1024);
+  const std::string level = env_or("CMD_SERVICE_COMPRESSION_LEVEL", "");
+  if (!level.empty()) g_config.compression_level = std::atoi(level.c_str());
+  g_config.cgroup_root = env_or("CMD_SERVICE_CGROUP_ROOT", "");
+  while (g_config.cgroup_root.size() > 1 && g_config.cgroup_root.back() == '/') {
+    g_config.cgroup_root.pop_back();
+  }
+  g_config.cgroup_cpu_max = env_or("CMD_SERVICE_CGROUP_CPU_MAX", "");
+  g_config.cgroup_memory_max = env_or("CMD_SERVICE_CGROUP_MEMORY_MAX", "");
+  g_config.cgroup_pids_max = env_or("CMD_SERVICE_CGROUP_PIDS_MAX", "");
+  g_config.access_log = env_or("CMD_SERVICE_ACCESS_LOG", "");
+  g_config.access_log_buffer = env_size_or("CMD_SERVICE_ACCESS_LOG_BUFFER", 8192);
+  g_config.access_log_max_bytes = env_size_or("CMD_SERVICE_ACCESS_LOG_MAX_BYTES", 64 << 20);
+  g_config.access_log_keep = env_size_or("CMD_SERVICE_ACCESS_LOG_KEEP", 5);
+  g_config.handoff_socket = env_or("CMD_SERVICE_HANDOFF_SOCKET", "");
+  g_config.drain_sec = static_cast<int>(env_size_or("CMD_SERVICE_DRAIN_SEC", 30));
+}
+
+// Keeps the first `head_limit` bytes and a ring of the last `tail_limit`
+// bytes, so a command's output never costs more than head + tail in memory.
+class OutputBuffer {
+public:
+  OutputBuffer(size_t head_limit, size_t tail_limit)
+      : head_limit_(head_limit), tail_limit_(tail_limit) {}
+
+  void append(const char *data, size_t len) {
+    total_ += len;
+    if (head_.size() < head_limit_) {
+      size_t n = std::min(len, head_limit_ - head_.size());
+      head_.append(data, n);
+      data += n;
+      len -= n;
+    }
+    if (len == 0 || tail_limit_ == 0) return;
+
+    if (len >= tail_limit_) {
+      data += len - tail_limit_;
+      len = tail_limit_;
+    }
+    if (tail_.size() < tail_limit_) tail_.resize(tail_limit_);
+    size_t first = std::min(len, tail_limit_ - tail_pos_);
+    std::copy(data, data + first, &tail_[tail_pos_]);
+    std::copy(data + first, data + len, &tail_[0]);
+    tail_pos_ = (tail_pos_ + len) % tail_limit_;
+    tail_used_ = std::min(tail_limit_, tail_used_ + len);
+  }
+
+  bool truncated() const { return total_ > head_.size() + tail_used_; }
+  size_t total() const { return total_; }
+
+  // Head followed by the retained tail, oldest byte first.
+  std::string take() {
+    std::string out = std::move(head_);
+    out.reserve(out.size() + tail_used_);
+    if (tail_used_ < tail_limit_) {
+      out.append(tail_, 0, tail_used_);
+    } else {
+      out.append(tail_, tail_pos_, std::string::npos);
+      out.append(tail_, 0, tail_pos_);
+    }
+    return out;
+  }
+
+private:
+  size_t head_limit_;
+  size_t tail_limit_;
+  size_t total_ = 0;
+  std::string head_;
+  std::string tail_;
+  size_t tail_pos_ = 0;
+  size_t tail_used_ = 0;
+};
+
+// `requested` may lower `ceiling` (0 leaves it); up to half is kept as tail.
+OutputBuffer make_capped_buffer(size_t requested, size_t ceiling) {
+  size_t cap = requested ? std::min(requested, ceiling) : ceiling;
+  size_t tail = std::min(g_config.output_tail, cap / 2);
+  return OutputBuffer(cap - tail, tail);
+}
+
+OutputBuffer make_output_buffer(const RunOptions &opts) {
+  return make_capped_buffer(opts.output_cap, g_config.output_cap);
+}
+
+OutputBuffer make_stderr_buffer(const RunOptions &opts) {
+  return make_capped_buffer(opts.stderr_cap, g_config.stderr_cap);
+}
+
+// Bytes that can't appear raw inside a JSON string: '"', '\\' and controls.
+inline bool json_needs_escape(unsigned char c) { return c < 0x20 || c == '"' || c == '\\'; }
+
+// First byte in [p, end) that needs escaping, 16 bytes per step with SSE2.
+const char *json_next_special(const char *p, const char *end) {
+#if defined(__SSE2__)
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i max_control = _mm_set1_epi8(0x1f);
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    // Unsigned v <= 0x1f exactly when min(v, 0x1f) == v.
+    __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)),
+                               _mm_cmpeq_epi8(_mm_min_epu8(v, max_control), v));
+    int mask = _mm_movemask_epi8(hit);
+    if (mask) return p + __builtin_ctz(static_cast<unsigned>(mask));
+    p += 16;
+  }
+#endif
+  while (p < end && !json_needs_escape(static_cast<unsigned char>(*p))) p++;
+  return p;
+}
+
+// Short form of an escape, or 0 when the byte needs \u00XX.
+char json_short_escape(unsigned char c) {
+  switch (c) {
+    case '"': return '"';
+    case '\\': return '\\';
+    case '\n': return 'n';
+    case '\r': return 'r';
+    case '\t': return 't';
+    case '\b': return 'b';
+    case '\f': return 'f';
+    default: return 0;
+  }
+}
+
+// Length of `s` once escaped, so callers can size their buffer up front.
+size_t json_escaped_size(const char *s, size_t n) {
+  const char *end = s + n;
+  size_t size = n;
+  for (const char *p = json_next_special(s, end); p < end; p = json_next_special(p + 1, end)) {
+    size += json_short_escape(static_cast<unsigned char>(*p)) ? 1 : 5;
+  }
+  return size;
+}
+
+// Appends `s` as the inside of a JSON string literal, copying clean runs in
+// bulk. Control bytes get their short form or \u00XX, so the output is valid
+// JSON; bytes >= 0x80 pass through unchanged.
+void json_escape_append(std::string &out, const char *s, size_t n) {
+  static const char kHex[] = "0123456789abcdef";
+  const char *end = s + n;
+  while (s < end) {
+    const char *p = json_next_special(s, end);
+    out.append(s, p - s);
+    if (p == end) break;
+    unsigned char c = static_cast<unsigned char>(*p);
+    char short_form = json_short_escape(c);
+    if (short_form) {
+      const char esc[2] = {'\\', short_form};
+      out.append(esc, 2);
+    } else {
+      const char esc[6] = {'\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xf]};
+      out.append(esc, 6);
     }
+    s = p + 1;
   }
+}
+
+std::string json_escape(const std::string &s) {
+  std::string out;
+  out.reserve(json_escaped_size(s.data(), s.size()));
+  json_escape_append(out, s.data(), s.size());
   return out;
 }
 
+// Writes one flat JSON object straight into `out`, field by field, without
+// building temporaries. Callers reserve `out` first when they know the size.
+class JsonWriter {
+public:
+  explicit JsonWriter(std::string &out) : out_(out) { out_ += '{'; }
+
+  JsonWriter &str(const char *key, const char *value, size_t n) {
+    name(key);
+    out_ += '"';
+    json_escape_append(out_, value, n);
+    out_ += '"';
+    return *this;
+  }
+  JsonWriter &str(const char *key, const std::string &value) {
+    return str(key, value.data(), value.size());
+  }
+  JsonWriter &num(const char *key, long long value) {
+    name(key);
+    char buf[24];
+    auto r = std::to_chars(buf, buf + sizeof(buf), value);
+    out_.append(buf, r.ptr - buf);
+    return *this;
+  }
+  JsonWriter &boolean(const char *key, bool value) {
+    name(key);
+    out_ += value ? "true" : "false";
+    return *this;
+  }
+  void close() { out_ += '}'; }
+
+  // Room for a field's key and punctuation, on top of its value.
+  static size_t field_size(const char *key) { return std::strlen(key) + 4; }
+
+private:
+  void name(const char *key) {
+    if (!first_) out_ += ',';
+    first_ = false;
+    out_ += '"';
+    out_ += key;
+    out_ += "\":";
+  }
+
+  std::string &out_;
+  bool first_ = true;
+};
+
+// The result fields shared by /run and /jobs, and the space they take.
+void write_result_fields(JsonWriter &w, const ExecResult &r) {
+  w.num("exit_code", r.exit_code)
+      .boolean("timed_out", r.timed_out)
+      .boolean("truncated", r.truncated)
+      .num("output_bytes", static_cast<long long>(r.output_bytes))
+      .str("output", r.output);
+  if (r.split_stderr) {
+    w.str("stderr", r.stderr_output)
+        .boolean("stderr_truncated", r.stderr_truncated)
+        .num("stderr_bytes", static_cast<long long>(r.stderr_bytes));
+  }
+  if (r.usage.measured) {
+    w.num("cpu_usec", static_cast<long long>(r.usage.cpu_usec))
+        .num("user_usec", static_cast<long long>(r.usage.user_usec))
+        .num("system_usec", static_cast<long long>(r.usage.system_usec))
+        .num("memory_peak_bytes", static_cast<long long>(r.usage.memory_peak_bytes))
+        .num("io_read_bytes", static_cast<long long>(r.usage.io_read_bytes))
+        .num("io_write_bytes", static_cast<long long>(r.usage.io_write_bytes));
+  }
+}
+
+size_t result_fields_size(const ExecResult &r) {
+  return 96 + (r.usage.measured ? 224 : 0) + json_escaped_size(r.output.data(), r.output.size()) +
+         (r.split_stderr ? 64 + json_escaped_size(r.stderr_output.data(), r.stderr_output.size())
+                         : 0);
+}
+
+// Picks a codec the client accepts and this build has, in httplib's order of
+// preference. Used for streams whose content type httplib won't compress.
+std::unique_ptr<httplib::detail::compressor> negotiate_compressor(const httplib::Request &req,
+                                                                  std::string &encoding) {
+  using httplib::detail::EncodingType;
+  const std::string accept = req.get_header_value("Accept-Encoding");
+  for (auto candidate : {std::make_pair("br", EncodingType::Brotli),
+                         std::make_pair("gzip", EncodingType::Gzip),
+                         std::make_pair("zstd", EncodingType::Zstd)}) {
+    if (accept.find(candidate.first) == std::string::npos) continue;
+    auto compressor =
+        httplib::detail::make_compressor(candidate.second, g_config.compression_level, encoding);
+    if (compressor) return compressor;
+  }
+  return nullptr;
+}
+
 std::string trim_copy(const std::string &s) {
   size_t start = 0;
   while (start < s.size() && std::isspace(static_cast<unsigned char>(s[start]))) start++;
@@ -80,184 +542,3343 @@ std::string decode_json_string_like(const std::string &s) {
   return out;
 }
 
-bool is_blocked_command(const std::string &command, std::string &reason) {
-  const std::string lower = to_lower_copy(command);
+void append_utf8(std::string &out, uint32_t cp) {
+  if (cp < 0x80) {
+    out += static_cast<char>(cp);
+  } else if (cp < 0x800) {
+    out += static_cast<char>(0xC0 | (cp >> 6));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else if (cp < 0x10000) {
+    out += static_cast<char>(0xE0 | (cp >> 12));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (cp >> 18));
+    out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (cp & 0x3F));
+  }
+}
 
-  if (lower.find("--no-preserve-root") != std::string::npos) {
-    reason = "dangerous rm flag";
+// Parses a JSON array of strings, e.g. ["uptime", "df -h"]. Anything else,
+// including non-string elements, is an error.
+bool parse_json_string_array(const std::string &s, std::vector<std::string> &out,
+                             std::string &error) {
+  size_t i = 0;
+  auto skip_ws = [&] {
+    while (i < s.size() && std::isspace(static_cast<unsigned char>(s[i]))) i++;
+  };
+  auto hex4 = [&](uint32_t &cp) {
+    if (i + 4 > s.size()) return false;
+    cp = 0;
+    for (size_t k = 0; k < 4; ++k) {
+      char c = s[i++];
+      cp <<= 4;
+      if (c >= '0' && c <= '9') {
+        cp |= static_cast<uint32_t>(c - '0');
+      } else if (c >= 'a' && c <= 'f') {
+        cp |= static_cast<uint32_t>(c - 'a' + 10);
+      } else if (c >= 'A' && c <= 'F') {
+        cp |= static_cast<uint32_t>(c - 'A' + 10);
+      } else {
+        return false;
+      }
+    }
     return true;
+  };
+
+  skip_ws();
+  if (i >= s.size() || s[i] != '[') {
+    error = "expected a JSON array of strings";
+    return false;
   }
+  ++i;
+  skip_ws();
+  if (i < s.size() && s[i] == ']') return true;
 
-  static const std::regex kRmRootRf1(
-      R"(\brm\b[^;&|]*-[^;&|]*r[^;&|]*f[^;&|]*\s+(/\s*($|[;&|])|/\*\s*($|[;&|])))");
-  static const std::regex kRmRootRf2(
-      R"(\brm\b[^;&|]*-[^;&|]*f[^;&|]*r[^;&|]*\s+(/\s*($|[;&|])|/\*\s*($|[;&|])))");
-  if (std::regex_search(lower, kRmRootRf1) || std::regex_search(lower, kRmRootRf2)) {
-    reason = "root filesystem deletion";
-    return true;
+  while (true) {
+    skip_ws();
+    if (i >= s.size() || s[i] != '"') {
+      error = "expected a string at offset " + std::to_string(i);
+      return false;
+    }
+    ++i;
+    std::string value;
+    while (true) {
+      if (i >= s.size()) {
+        error = "unterminated string";
+        return false;
+      }
+      char c = s[i++];
+      if (c == '"') break;
+      if (c != '\\') {
+        value += c;
+        continue;
+      }
+      if (i >= s.size()) continue;
+      char n = s[i++];
+      switch (n) {
+        case 'n': value += '\n'; break;
+        case 'r': value += '\r'; break;
+        case 't': value += '\t'; break;
+        case 'b': value += '\b'; break;
+        case 'f': value += '\f'; break;
+        case 'u': {
+          uint32_t cp;
+          if (!hex4(cp)) {
+            error = "bad \\u escape at offset " + std::to_string(i);
+            return false;
+          }
+          uint32_t low;
+          if (cp >= 0xD800 && cp < 0xDC00 && i + 1 < s.size() && s[i] == '\\' &&
+              s[i + 1] == 'u') {
+            i += 2;
+            if (!hex4(low) || low < 0xDC00 || low >= 0xE000) {
+              error = "bad surrogate pair at offset " + std::to_string(i);
+              return false;
+            }
+            cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+          }
+          append_utf8(value, cp);
+          break;
+        }
+        default: value += n; break;
+      }
+    }
+    out.push_back(std::move(value));
+
+    skip_ws();
+    if (i < s.size() && s[i] == ',') {
+      ++i;
+      continue;
+    }
+    if (i < s.size() && s[i] == ']') {
+      ++i;
+      skip_ws();
+      if (i == s.size()) return true;
+    }
+    error = "expected ',' or ']' at offset " + std::to_string(i);
+    return false;
   }
+}
 
-  static const std::vector<std::pair<std::regex, const char *>> kBlockedPatterns = {
-      {std::regex(R"((^|[;&|])\s*(shutdown|reboot|halt|poweroff)\b)"),
-       "power control command"},
-      {std::regex(R"((^|[;&|])\s*init\s+[06]\b)"), "runlevel switch command"},
-      {std::regex(R"((^|[;&|])\s*systemctl\s+(reboot|poweroff|halt)\b)"),
-       "system power control command"},
-      {std::regex(R"((^|[;&|])\s*(mkfs(\.[a-z0-9_+-]+)?|fdisk|sfdisk|parted|wipefs)\b)"),
-       "disk formatting/partition command"},
-      {std::regex(R"((^|[;&|])\s*dd\b)"), "raw disk copy command"},
-      {std::regex(R"(\b(of|if)=/dev/(sd[a-z]\d*|vd[a-z]\d*|nvme\d+n\d+(p\d+)?)\b)"),
-       "block-device access argument"},
-      {std::regex(R"((^|[;&|])\s*:\s*>\s*/dev/(sd[a-z]\d*|vd[a-z]\d*|nvme\d+n\d+(p\d+)?)\b)"),
-       "block-device overwrite"},
-      {std::regex(R"((^|[;&|])\s*kill\s+-9\s+-?1\b)"), "kill-all command"},
-  };
+std::vector<std::string> split_fields(const std::string &line, char sep) {
+  std::vector<std::string> fields;
+  size_t pos = 0;
+  for (size_t next; (next = line.find(sep, pos)) != std::string::npos; pos = next + 1) {
+    fields.push_back(line.substr(pos, next - pos));
+  }
+  fields.push_back(line.substr(pos));
+  return fields;
+}
 
-  for (const auto &item : kBlockedPatterns) {
-    if (std::regex_search(lower, item.first)) {
-      reason = item.second;
-      return true;
+// Blocklist matcher. Every rule lists literal keywords that any match of its
+// pattern must contain; one Aho-Corasick pass over the lower-cased command
+// finds which keywords occur, and only those rules run their regex. Rules are
+// tried in the order they were added so the first matching reason wins.
+class CommandFilter {
+public:
+  // An empty pattern makes the rule a plain substring match on its keywords.
+  void add_rule(const std::vector<std::string> &keywords, const std::string &pattern,
+                const std::string &reason) {
+    Rule rule;
+    rule.reason = reason;
+    rule.has_pattern = !pattern.empty();
+    if (rule.has_pattern) rule.pattern = std::regex(pattern, std::regex::optimize);
+    rule.always = keywords.empty();
+    rules_.push_back(std::move(rule));
+    for (const auto &keyword : keywords) {
+      if (!keyword.empty()) keywords_.emplace_back(to_lower_copy(keyword), rules_.size() - 1);
+    }
+  }
+
+  // Builds the automaton; call once after the last add_rule.
+  void compile() {
+    classes_.fill(0);
+    size_t class_count = 1;
+    for (const auto &k : keywords_) {
+      for (unsigned char c : k.first) {
+        if (classes_[c] == 0) classes_[c] = static_cast<uint8_t>(class_count++);
+      }
+    }
+    class_count_ = class_count;
+
+    goto_.assign(class_count_, -1);
+    outputs_.assign(1, {});
+    for (const auto &k : keywords_) {
+      int state = 0;
+      for (unsigned char c : k.first) {
+        int &next = goto_[state * class_count_ + classes_[c]];
+        if (next < 0) {
+          next = static_cast<int>(outputs_.size());
+          outputs_.emplace_back();
+          goto_.resize(goto_.size() + class_count_, -1);
+        }
+        state = goto_[state * class_count_ + classes_[c]];
+      }
+      outputs_[state].push_back(k.second);
+    }
+
+    // Breadth-first fill of failure links, turning the trie into a DFA.
+    std::vector<int> fail(outputs_.size(), 0);
+    std::queue<int> pending;
+    for (size_t c = 0; c < class_count_; ++c) {
+      int &next = goto_[c];
+      if (next < 0) {
+        next = 0;
+      } else {
+        pending.push(next);
+      }
+    }
+    while (!pending.empty()) {
+      int state = pending.front();
+      pending.pop();
+      const auto &inherited = outputs_[fail[state]];
+      outputs_[state].insert(outputs_[state].end(), inherited.begin(), inherited.end());
+      for (size_t c = 0; c < class_count_; ++c) {
+        int &next = goto_[state * class_count_ + c];
+        int via_fail = goto_[fail[state] * class_count_ + c];
+        if (next < 0) {
+          next = via_fail;
+        } else {
+          fail[next] = via_fail;
+          pending.push(next);
+        }
+      }
+    }
+  }
+
+  bool match(const std::string &command, std::string &reason) const {
+    const std::string lower = to_lower_copy(command);
+
+    std::vector<size_t> candidates;
+    int state = 0;
+    for (unsigned char c : lower) {
+      state = goto_[state * class_count_ + classes_[c]];
+      const auto &out = outputs_[state];
+      candidates.insert(candidates.end(), out.begin(), out.end());
+    }
+    for (size_t i = 0; i < rules_.size(); ++i) {
+      if (rules_[i].always) candidates.push_back(i);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    for (size_t i : candidates) {
+      const Rule &rule = rules_[i];
+      if (!rule.has_pattern || std::regex_search(lower, rule.pattern)) {
+        reason = rule.reason;
+        return true;
+      }
     }
+    return false;
   }
-  return false;
+
+  size_t size() const { return rules_.size(); }
+
+private:
+  struct Rule {
+    std::string reason;
+    std::regex pattern;
+    bool has_pattern = false;
+    bool always = false;
+  };
+
+  std::vector<Rule> rules_;
+  std::vector<std::pair<std::string, size_t>> keywords_;
+  std::array<uint8_t, 256> classes_{};
+  size_t class_count_ = 1;
+  std::vector<int> goto_ = std::vector<int>(1, 0);
+  std::vector<std::vector<size_t>> outputs_ = std::vector<std::vector<size_t>>(1);
+};
+
+void add_builtin_rules(CommandFilter &filter) {
+  filter.add_rule({"--no-preserve-root"}, "", "dangerous rm flag");
+  filter.add_rule({"rm"},
+                  R"(\brm\b[^;&|]*-[^;&|]*r[^;&|]*f[^;&|]*\s+(/\s*($|[;&|])|/\*\s*($|[;&|])))",
+                  "root filesystem deletion");
+  filter.add_rule({"rm"},
+                  R"(\brm\b[^;&|]*-[^;&|]*f[^;&|]*r[^;&|]*\s+(/\s*($|[;&|])|/\*\s*($|[;&|])))",
+                  "root filesystem deletion");
+  filter.add_rule({"shutdown", "reboot", "halt", "poweroff"},
+                  R"((^|[;&|])\s*(shutdown|reboot|halt|poweroff)\b)", "power control command");
+  filter.add_rule({"init"}, R"((^|[;&|])\s*init\s+[06]\b)", "runlevel switch command");
+  filter.add_rule({"systemctl"}, R"((^|[;&|])\s*systemctl\s+(reboot|poweroff|halt)\b)",
+                  "system power control command");
+  filter.add_rule({"mkfs", "fdisk", "parted", "wipefs"},
+                  R"((^|[;&|])\s*(mkfs(\.[a-z0-9_+-]+)?|fdisk|sfdisk|parted|wipefs)\b)",
+                  "disk formatting/partition command");
+  filter.add_rule({"dd"}, R"((^|[;&|])\s*dd\b)", "raw disk copy command");
+  filter.add_rule({"=/dev/"}, R"(\b(of|if)=/dev/(sd[a-z]\d*|vd[a-z]\d*|nvme\d+n\d+(p\d+)?)\b)",
+                  "block-device access argument");
+  filter.add_rule({"/dev/"},
+                  R"((^|[;&|])\s*:\s*>\s*/dev/(sd[a-z]\d*|vd[a-z]\d*|nvme\d+n\d+(p\d+)?)\b)",
+                  "block-device overwrite");
+  filter.add_rule({"kill"}, R"((^|[;&|])\s*kill\s+-9\s+-?1\b)", "kill-all command");
 }
 
-ExecResult run_command(const std::string &command, int timeout_sec = 20) {
-  const std::string trimmed = trim_copy(command);
-  if (trimmed.empty()) return {false, -1, false, "", "empty command"};
-  if (trimmed.size() > 4096) return {false, -1, false, "", "command too long (max 4096 chars)"};
+// Extra rules, one per line: keywords<TAB>pattern<TAB>reason. Keywords are
+// comma-separated literals every match contains ("*" to always run the
+// pattern); a pattern of "-" blocks on the keywords alone. Lines starting
+// with '#' are comments.
+bool load_filter_rules(CommandFilter &filter, const std::string &path, std::string &error) {
+  std::ifstream in(path);
+  if (!in) {
+    error = "cannot open " + path;
+    return false;
+  }
 
-  std::string blocked_reason;
-  if (is_blocked_command(trimmed, blocked_reason)) {
-    return {false, -1, false, "", "blocked command: " + blocked_reason};
+  std::string line;
+  size_t lineno = 0;
+  while (std::getline(in, line)) {
+    ++lineno;
+    if (trim_copy(line).empty() || trim_copy(line)[0] == '#') continue;
+
+    std::vector<std::string> fields = split_fields(line, '\t');
+    if (fields.size() != 3) {
+      error = path + ":" + std::to_string(lineno) + ": expected 3 tab-separated fields";
+      return false;
+    }
+
+    std::vector<std::string> keywords;
+    if (trim_copy(fields[0]) != "*") {
+      for (const auto &k : split_fields(fields[0], ',')) {
+        if (!trim_copy(k).empty()) keywords.push_back(trim_copy(k));
+      }
+      if (keywords.empty()) {
+        error = path + ":" + std::to_string(lineno) + ": no keywords";
+        return false;
+      }
+    }
+    std::string pattern = trim_copy(fields[1]) == "-" ? "" : fields[1];
+    if (pattern.empty() && keywords.empty()) {
+      error = path + ":" + std::to_string(lineno) + ": rule would block every command";
+      return false;
+    }
+
+    try {
+      filter.add_rule(keywords, pattern, trim_copy(fields[2]));
+    } catch (const std::regex_error &e) {
+      error = path + ":" + std::to_string(lineno) + ": bad pattern: " + e.what();
+      return false;
+    }
   }
+  return true;
+}
 
-  int pipefd[2];
-  if (pipe(pipefd) != 0) return {false, -1, false, "", "pipe failed"};
+CommandFilter g_filter;
 
-  int flags = fcntl(pipefd[0], F_GETFL, 0);
-  fcntl(pipefd[0], F_SETFL, flags | O_NONBLOCK);
+bool is_blocked_command(const std::string &command, std::string &reason) {
+  return g_filter.match(command, reason);
+}
 
-  pid_t pid = fork();
-  if (pid < 0) {
-    close(pipefd[0]);
-    close(pipefd[1]);
-    return {false, -1, false, "", "fork failed"};
+// Environment handed to children: the snapshot taken at startup in
+// ShellMode::Snapshot, otherwise our own.
+std::vector<std::string> g_env_snapshot;
+std::vector<char *> g_env_snapshot_ptrs;
+
+char **child_environ() {
+  return g_env_snapshot_ptrs.empty() ? environ : g_env_snapshot_ptrs.data();
+}
+
+// Starts `path` with stdout and stderr redirected to `out_fd` (and stdin
+// from `in_fd` when given). `new_group` makes the child a process group
+// leader so everything it starts can be killed together. posix_spawn uses
+// vfork semantics in glibc, so its cost does not grow with the size of this
+// process the way fork's page-table copy does.
+// With `cgroup_fd` (an open cgroup.procs) the child moves itself into that
+// cgroup before exec, so nothing it starts can escape; posix_spawn has no
+// hook for that, so this always forks.
+pid_t launch_child(const char *path, char *const argv[], int out_fd, int in_fd = -1,
+                   bool new_group = false, int cgroup_fd = -1, int err_fd = -1) {
+  char **envp = child_environ();
+  if (g_config.launcher == Launcher::Fork || cgroup_fd >= 0) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      if (cgroup_fd >= 0 && write(cgroup_fd, "0", 1) != 1) _exit(126);
+      if (new_group) setpgid(0, 0);
+      if (in_fd >= 0) dup2(in_fd, STDIN_FILENO);
+      dup2(out_fd, STDOUT_FILENO);
+      dup2(err_fd >= 0 ? err_fd : out_fd, STDERR_FILENO);
+      execve(path, argv, envp);
+      _exit(127);
+    }
+    return pid;
   }
 
-  if (pid == 0) {
-    dup2(pipefd[1], STDOUT_FILENO);
-    dup2(pipefd[1], STDERR_FILENO);
-    close(pipefd[0]);
-    close(pipefd[1]);
+  posix_spawn_file_actions_t actions;
+  if (posix_spawn_file_actions_init(&actions) != 0) return -1;
+  if (in_fd >= 0) posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, err_fd >= 0 ? err_fd : out_fd, STDERR_FILENO);
 
-    char *const argv[] = {const_cast<char *>("bash"), const_cast<char *>("-lc"),
-                          const_cast<char *>(trimmed.c_str()), nullptr};
-    execv("/bin/bash", argv);
-    _exit(127);
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  if (new_group) {
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
   }
 
-  close(pipefd[1]);
+  pid_t pid = -1;
+  int rc = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  return rc == 0 ? pid : -1;
+}
 
-  std::string output;
-  char buf[4096];
-  int status = 0;
-  bool timed_out = false;
-  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(timeout_sec);
+// Splits a command into words when the shell would do nothing but split it
+// on blanks: no quoting, expansion, redirection, globbing, assignments or
+// builtins. Anything else returns false and goes through the shell.
+bool split_simple_command(const std::string &command, std::vector<std::string> &words) {
+  static const char kShellSpecial[] = "|&;<>()$`\\\"'*?[]#~=%{}!\n\r";
+  if (command.find_first_of(kShellSpecial) != std::string::npos) return false;
 
-  while (true) {
-    ssize_t n = read(pipefd[0], buf, sizeof(buf));
-    if (n > 0) output.append(buf, n);
+  words.clear();
+  size_t pos = 0;
+  while (pos < command.size()) {
+    size_t start = command.find_first_not_of(" \t", pos);
+    if (start == std::string::npos) break;
+    size_t end = command.find_first_of(" \t", start);
+    if (end == std::string::npos) end = command.size();
+    words.push_back(command.substr(start, end - start));
+    pos = end;
+  }
+  if (words.empty()) return false;
 
-    pid_t ret = waitpid(pid, &status, WNOHANG);
-    if (ret == pid) break;
+  static const std::unordered_set<std::string> kBuiltins = {
+      "alias", "bg", "bind", "break", "builtin", "caller", "case", "cd", "command",
+      "compgen", "complete", "continue", "declare", "dirs", "disown", "do", "done",
+      "elif", "else", "enable", "esac", "eval", "exec", "exit", "export", "fc", "fg",
+      "fi", "for", "function", "getopts", "hash", "help", "history", "if", "jobs",
+      "let", "local", "logout", "mapfile", "popd", "pushd", "read", "readarray",
+      "readonly", "return", "select", "set", "shift", "shopt", "source", "suspend",
+      "then", "time", "times", "trap", "type", "typeset", "ulimit", "umask", "unalias",
+      "unset", "until", "wait", "while", ".",
+  };
+  return kBuiltins.count(words[0]) == 0;
+}
 
-    if (std::chrono::steady_clock::now() > deadline) {
-      timed_out = true;
-      kill(pid, SIGKILL);
-      waitpid(pid, &status, 0);
+// Looks `name` up in the child's PATH; returns "" when it is not executable.
+std::string resolve_executable(const std::string &name) {
+  if (name.find('/') != std::string::npos) return access(name.c_str(), X_OK) == 0 ? name : "";
+
+  std::string path = "/usr/local/bin:/usr/bin:/bin";
+  for (char **env = child_environ(); *env; ++env) {
+    if (std::strncmp(*env, "PATH=", 5) == 0) {
+      path = *env + 5;
       break;
     }
-    usleep(50000);
   }
+  for (const auto &dir : split_fields(path, ':')) {
+    std::string candidate = (dir.empty() ? "." : dir) + "/" + name;
+    struct stat st;
+    if (stat(candidate.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+        access(candidate.c_str(), X_OK) == 0) {
+      return candidate;
+    }
+  }
+  return "";
+}
 
-  while (true) {
-    ssize_t n = read(pipefd[0], buf, sizeof(buf));
-    if (n > 0) output.append(buf, n);
-    else break;
+pid_t launch_command(const std::string &command, int out_fd, int cgroup_fd = -1,
+                     int err_fd = -1) {
+  std::vector<std::string> words;
+  if (g_config.direct_exec && split_simple_command(command, words)) {
+    std::string path = resolve_executable(words[0]);
+    if (!path.empty()) {
+      std::vector<char *> argv;
+      for (auto &w : words) argv.push_back(const_cast<char *>(w.c_str()));
+      argv.push_back(nullptr);
+      return launch_child(path.c_str(), argv.data(), out_fd, -1, false, cgroup_fd, err_fd);
+    }
   }
-  close(pipefd[0]);
 
-  int code = timed_out ? -2 : (WIFEXITED(status) ? WEXITSTATUS(status) : -1);
-  return {true, code, timed_out, output, ""};
+  const char *flag = g_config.shell_mode == ShellMode::Login ? "-lc" : "-c";
+  std::string name = g_config.shell.substr(g_config.shell.rfind('/') + 1);
+  char *const argv[] = {const_cast<char *>(name.c_str()), const_cast<char *>(flag),
+                        const_cast<char *>(command.c_str()), nullptr};
+  return launch_child(g_config.shell.c_str(), argv, out_fd, -1, false, cgroup_fd, err_fd);
 }
 
-int main() {
-  httplib::Server svr;
+bool write_file_string(const std::string &path, const std::string &value) {
+  int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  bool ok = write(fd, value.data(), value.size()) == static_cast<ssize_t>(value.size());
+  close(fd);
+  return ok;
+}
 
-  svr.Get("/health", [](const httplib::Request &, httplib::Response &res) {
-    res.set_content("{\"ok\":true}", "application/json");
-  });
+bool read_file_string(const std::string &path, std::string &out) {
+  std::ifstream in(path);
+  if (!in) return false;
+  out.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  return true;
+}
 
-  svr.Get("/tasks", [](const httplib::Request &, httplib::Response &res) {
-    res.set_content(
-        "{\"mode\":\"direct_command\",\"usage\":\"POST /run with raw command body\","
-        "\"auth\":\"Authorization: Bearer <token>\"}",
-                    "application/json");
-  });
+// Turns on the controllers the limits need for children of the root. Fails
+// if the root can't be written (not delegated to this user, or not v2).
+bool prepare_cgroup_root(std::string &error) {
+  struct stat st;
+  if (stat((g_config.cgroup_root + "/cgroup.procs").c_str(), &st) != 0) {
+    error = g_config.cgroup_root + " is not a cgroup v2 directory";
+    return false;
+  }
+  std::string available;
+  read_file_string(g_config.cgroup_root + "/cgroup.controllers", available);
+  for (const char *controller : {"cpu", "memory", "pids", "io"}) {
+    if (available.find(controller) == std::string::npos) continue;
+    if (!write_file_string(g_config.cgroup_root + "/cgroup.subtree_control",
+                           std::string("+") + controller)) {
+      std::cerr << "cannot enable the " << controller << " controller under "
+                << g_config.cgroup_root << "\n";
+    }
+  }
+  return true;
+}
 
-  auto parse_authorization = [](const std::string &value) -> std::string {
-    std::string auth = trim_copy(value);
-    if (auth.empty()) return "";
-    std::string lower = to_lower_copy(auth);
-    const std::string prefix = "bearer ";
-    if (lower.rfind(prefix, 0) == 0) return trim_copy(auth.substr(prefix.size()));
-    return auth;
-  };
+// A transient cgroup for one command: created with the configured limits
+// before launch, read back for accounting after exit, and emptied (so
+// background children die with the command) and removed on destruction.
+class CommandCgroup {
+public:
+  CommandCgroup() = default;
+  CommandCgroup(const CommandCgroup &) = delete;
 
-  auto authorize = [parse_authorization](const httplib::Request &req, httplib::Response &res) -> bool {
-    const char *token = std::getenv("CMD_SERVICE_TOKEN");
-    std::string got = parse_authorization(req.get_header_value("Authorization"));
-    if (!token || got != token) {
-      res.status = 401;
-      res.set_content(
-          "{\"error\":\"unauthorized: expected Authorization header (Bearer <token>)\"}",
-          "application/json");
+  ~CommandCgroup() {
+    if (procs_fd_ >= 0) close(procs_fd_);
+    if (path_.empty()) return;
+    write_file_string(path_ + "/cgroup.kill", "1");
+    // The kill is asynchronous and rmdir fails while the cgroup is populated.
+    for (int i = 0; i < 100 && rmdir(path_.c_str()) != 0 && errno == EBUSY; ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  bool create(std::string &error) {
+    static std::atomic<uint64_t> next_id{0};
+    path_ = g_config.cgroup_root + "/cmd-" + std::to_string(getpid()) + "-" +
+            std::to_string(next_id.fetch_add(1, std::memory_order_relaxed));
+    if (mkdir(path_.c_str(), 0755) != 0) {
+      error = "cgroup mkdir failed: " + std::string(std::strerror(errno));
+      path_.clear();
+      return false;
+    }
+    for (const auto &limit : {std::make_pair("cpu.max", &g_config.cgroup_cpu_max),
+                              std::make_pair("memory.max", &g_config.cgroup_memory_max),
+                              std::make_pair("pids.max", &g_config.cgroup_pids_max)}) {
+      if (!limit.second->empty() && !write_file_string(path_ + "/" + limit.first, *limit.second)) {
+        error = std::string("cannot set ") + limit.first + ": " + std::strerror(errno);
+        return false;
+      }
+    }
+    procs_fd_ = open((path_ + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+    if (procs_fd_ < 0) {
+      error = "cannot open cgroup.procs: " + std::string(std::strerror(errno));
       return false;
     }
     return true;
-  };
+  }
 
-  auto render_result = [](const std::string &command, const ExecResult &r, httplib::Response &res) {
-    if (!r.ok) {
-      res.status = (r.error.rfind("blocked command:", 0) == 0) ? 403 : 400;
-      res.set_content("{\"error\":\"" + json_escape(r.error) + "\"}", "application/json");
-      return;
+  int procs_fd() const { return procs_fd_; }
+
+  ResourceUsage usage() const {
+    ResourceUsage u;
+    std::string text;
+    if (!read_file_string(path_ + "/cpu.stat", text)) return u;
+    u.measured = true;
+    u.cpu_usec = stat_field(text, "usage_usec");
+    u.user_usec = stat_field(text, "user_usec");
+    u.system_usec = stat_field(text, "system_usec");
+    if (read_file_string(path_ + "/memory.peak", text)) u.memory_peak_bytes = stat_value(text, 0);
+    // One line per device: "8:0 rbytes=N wbytes=N rios=N ...".
+    if (read_file_string(path_ + "/io.stat", text)) {
+      for (size_t pos = 0; (pos = text.find("bytes=", pos)) != std::string::npos; pos += 6) {
+        uint64_t n = stat_value(text, pos + 6);
+        if (pos > 0 && text[pos - 1] == 'r') u.io_read_bytes += n;
+        if (pos > 0 && text[pos - 1] == 'w') u.io_write_bytes += n;
+      }
     }
+    return u;
+  }
 
-    std::string body = "{\"command\":\"" + json_escape(command) + "\",\"exit_code\":" +
-                       std::to_string(r.exit_code) + ",\"timed_out\":" +
-                       (r.timed_out ? "true" : "false") + ",\"output\":\"" +
-                       json_escape(r.output) + "\"}";
-    res.set_content(body, "application/json");
-  };
+private:
+  static uint64_t stat_value(const std::string &text, size_t pos) {
+    return std::strtoull(text.c_str() + pos, nullptr, 10);
+  }
 
-  svr.Post("/run", [authorize, render_result](const httplib::Request &req, httplib::Response &res) {
-    if (!authorize(req, res)) return;
+  // `key value` lines, as in cpu.stat.
+  static uint64_t stat_field(const std::string &text, const std::string &key) {
+    for (size_t pos = 0; (pos = text.find(key, pos)) != std::string::npos; pos += key.size()) {
+      if ((pos == 0 || text[pos - 1] == '\n') && text.compare(pos + key.size(), 1, " ") == 0) {
+        return stat_value(text, pos + key.size() + 1);
+      }
+    }
+    return 0;
+  }
 
-    std::string command = trim_copy(req.body);
-    command = trim_copy(decode_json_string_like(command));
-    if (command.empty()) {
-      res.status = 400;
-      res.set_content("{\"error\":\"missing command: send command in request body\"}",
-                      "application/json");
-      return;
+  std::string path_;
+  int procs_fd_ = -1;
+};
+
+int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+int remaining_ms(std::chrono::steady_clock::time_point deadline) {
+  auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now());
+  if (left.count() <= 0) return 0;
+  // Round up so the final poll lands on or after the deadline, not just before.
+  return static_cast<int>(left.count()) + 1;
+}
+
+std::chrono::steady_clock::time_point command_deadline(const RunOptions &opts) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(opts.timeout_sec);
+  if (opts.deadline != std::chrono::steady_clock::time_point{}) {
+    deadline = std::min(deadline, opts.deadline);
+  }
+  return deadline;
+}
+
+// Prometheus histogram with fixed buckets. observe() only touches atomics,
+// so instrumented paths never take a lock.
+class Histogram {
+public:
+  Histogram(const char *name, const char *help, std::vector<double> bounds)
+      : name_(name), help_(help), bounds_(std::move(bounds)),
+        buckets_(new std::atomic<uint64_t>[bounds_.size() + 1]) {
+    for (size_t i = 0; i <= bounds_.size(); ++i) buckets_[i] = 0;
+  }
+
+  void observe(double value) {
+    // First bound >= value: Prometheus buckets are inclusive ("le").
+    size_t i = std::lower_bound(bounds_.begin(), bounds_.end(), value) - bounds_.begin();
+    buckets_[i].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    double sum = sum_.load(std::memory_order_relaxed);
+    while (!sum_.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed)) {
     }
+  }
 
-    ExecResult r = run_command(command);
-    render_result(command, r, res);
-  });
+  void render(std::string &out) const {
+    out += std::string("# HELP ") + name_ + " " + help_ + "\n# TYPE " + name_ + " histogram\n";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i <= bounds_.size(); ++i) {
+      cumulative += buckets_[i].load(std::memory_order_relaxed);
+      std::string le = i < bounds_.size() ? format_double(bounds_[i]) : "+Inf";
+      out += std::string(name_) + "_bucket{le=\"" + le + "\"} " + std::to_string(cumulative) +
+             "\n";
+    }
+    out += std::string(name_) + "_sum " + format_double(sum_.load()) + "\n";
+    out += std::string(name_) + "_count " + std::to_string(count_.load()) + "\n";
+  }
+
+  static std::string format_double(double v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9g", v);
+    return buf;
+  }
+
+private:
+  const char *name_;
+  const char *help_;
+  std::vector<double> bounds_;
+  std::unique_ptr<std::atomic<uint64_t>[]> buckets_;
+  std::atomic<uint64_t> count_{0};
+  std::atomic<double> sum_{0};
+};
+
+std::vector<double> latency_buckets() {
+  return {0.000005, 0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+          0.005,    0.01,    0.025,    0.05,    0.1,    0.25,    0.5,    1,     2.5,
+          5,        10,      30};
+}
+
+struct Metrics {
+  Histogram request_seconds{"cmd_service_request_seconds",
+                            "Time from routing to response logged.", latency_buckets()};
+  Histogram auth_seconds{"cmd_service_auth_seconds", "Time spent in authorize.",
+                         latency_buckets()};
+  Histogram filter_seconds{"cmd_service_filter_seconds", "Time spent in is_blocked_command.",
+                           latency_buckets()};
+  Histogram spawn_seconds{"cmd_service_spawn_seconds", "Time to launch a child process.",
+                          latency_buckets()};
+  Histogram child_seconds{"cmd_service_child_seconds",
+                          "Time from launch until the command finished.", latency_buckets()};
+  Histogram render_seconds{"cmd_service_render_seconds", "Time to render a JSON result.",
+                           latency_buckets()};
+  Histogram output_bytes{"cmd_service_output_bytes", "Bytes printed per command.",
+                         {0, 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304,
+                          16777216, 67108864, 268435456}};
+  std::atomic<uint64_t> responses[6] = {};  // by status class, index status / 100
+  std::atomic<uint64_t> commands_ok{0};
+  std::atomic<uint64_t> commands_timed_out{0};
+  std::atomic<uint64_t> commands_failed{0};
+  std::atomic<uint64_t> auth_unauthorized{0};
+  std::atomic<uint64_t> auth_rate_limited{0};
+};
+
+Metrics g_metrics;
+
+class ScopedTimer {
+public:
+  explicit ScopedTimer(Histogram &h) : h_(h), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedTimer() { h_.observe(seconds_since(start_)); }
+
+  static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+private:
+  Histogram &h_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+struct PoolStats {
+  size_t queued = 0, idle = 0, threads = 0;
+};
+
+// The server creates one HTTP worker pool per listener. Each registers here
+// while it is alive so /metrics can report their sum.
+std::mutex g_http_pools_mutex;
+std::unordered_map<const void *, std::function<void(PoolStats &)>> g_http_pools;
+
+PoolStats http_pool_stats() {
+  PoolStats stats;
+  std::lock_guard<std::mutex> lock(g_http_pools_mutex);
+  for (const auto &entry : g_http_pools) {
+    entry.second(stats);
+  }
+  return stats;
+}
+
+template <class Pool>
+class TrackedPool : public httplib::TaskQueue {
+public:
+  template <class... Args>
+  explicit TrackedPool(Args &&...args) : pool_(std::forward<Args>(args)...) {
+    std::lock_guard<std::mutex> lock(g_http_pools_mutex);
+    g_http_pools[this] = [this](PoolStats &stats) {
+      stats.queued += pool_.queued_count();
+      stats.idle += pool_.idle_count();
+      stats.threads += pool_.thread_count();
+    };
+  }
+
+  ~TrackedPool() override {
+    std::lock_guard<std::mutex> lock(g_http_pools_mutex);
+    g_http_pools.erase(this);
+  }
+
+  bool enqueue(std::function<void()> fn) override { return pool_.enqueue(std::move(fn)); }
+  void shutdown() override { pool_.shutdown(); }
+
+private:
+  Pool pool_;
+};
+
+bool check_command(const std::string &trimmed, std::string &error) {
+  if (trimmed.empty()) {
+    error = "empty command";
+    return false;
+  }
+  if (trimmed.size() > 4096) {
+    error = "command too long (max 4096 chars)";
+    return false;
+  }
+  std::string blocked_reason;
+  bool blocked;
+  {
+    ScopedTimer timer(g_metrics.filter_seconds);
+    blocked = is_blocked_command(trimmed, blocked_reason);
+  }
+  if (blocked) {
+    error = "blocked command: " + blocked_reason;
+    return false;
+  }
+  return true;
+}
+
+// A long-lived shell that runs one command at a time from its stdin. Each
+// command is evaluated in a subshell, so cd/export/exit cannot leak into the
+// next one, and is followed by a line carrying a per-worker random token and
+// the exit status, which marks where the command's output ends.
+//
+// With job control on, the subshell gets a process group of its own, which is
+// killed once it exits: background jobs it left behind would otherwise keep
+// writing into the shared pipe during later commands. Output that still shows
+// up after the marker retires the worker.
+class ShellWorker {
+public:
+  ~ShellWorker() {
+    if (in_fd_ >= 0) close(in_fd_);
+    if (pid_ > 0) {
+      // The TERM trap kills the running command's group, then the shell exits.
+      kill(pid_, SIGTERM);
+      bool exited = false;
+      for (int i = 0; i < 100 && !exited; ++i) {
+        exited = waitpid(pid_, nullptr, WNOHANG) == pid_;
+        if (!exited) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      if (!exited) {
+        kill(-pid_, SIGKILL);
+        waitpid(pid_, nullptr, 0);
+      }
+    }
+    if (out_fd_ >= 0) close(out_fd_);
+  }
+
+  // Waits for the shell to come up until `deadline`, and never more than 30s.
+  static std::unique_ptr<ShellWorker> start(
+      std::string &error, std::chrono::steady_clock::time_point deadline =
+                              std::chrono::steady_clock::time_point::max()) {
+    std::unique_ptr<ShellWorker> w(new ShellWorker());
+
+    int in_pipe[2], out_pipe[2];
+    if (pipe2(in_pipe, O_CLOEXEC) != 0) {
+      error = "pipe failed";
+      return nullptr;
+    }
+    if (pipe2(out_pipe, O_CLOEXEC) != 0) {
+      close(in_pipe[0]);
+      close(in_pipe[1]);
+      error = "pipe failed";
+      return nullptr;
+    }
+    w->in_fd_ = in_pipe[1];
+    w->out_fd_ = out_pipe[0];
+    fcntl(w->out_fd_, F_SETFL, fcntl(w->out_fd_, F_GETFL, 0) | O_NONBLOCK);
+
+    std::string name = g_config.shell.substr(g_config.shell.rfind('/') + 1);
+    std::vector<char *> argv = {const_cast<char *>(name.c_str())};
+    if (g_config.shell_mode == ShellMode::Login) argv.push_back(const_cast<char *>("-l"));
+    argv.push_back(const_cast<char *>("-s"));
+    argv.push_back(nullptr);
+    w->pid_ = launch_child(g_config.shell.c_str(), argv.data(), out_pipe[1], in_pipe[0], true);
+    close(in_pipe[0]);
+    close(out_pipe[1]);
+    if (w->pid_ < 0) {
+      error = "spawn failed";
+      return nullptr;
+    }
+
+    std::random_device rd;
+    char token[48];
+    snprintf(token, sizeof(token), "__cmd_service_%08x%08x%08x__", rd(), rd(), rd());
+    w->token_ = token;
+
+    // Swallow whatever the profile scripts print before the first command.
+    int code = 0;
+    deadline = std::min(deadline, std::chrono::steady_clock::now() + std::chrono::seconds(30));
+    if (!w->write_all("set -m\n"
+                      "trap '[ -n \"$__cmd_service_p\" ] && kill -KILL -- "
+                      "\"-$__cmd_service_p\" 2>/dev/null; exit 143' TERM\n") ||
+        !w->send("true") ||
+        w->read_result(deadline, [](const char *, size_t) { return true; }, code) != 0) {
+      error = "shell worker did not start";
+      return nullptr;
+    }
+    return w;
+  }
+
+  // Runs one command. Returns false when the worker must not be reused.
+  bool run(const std::string &command, std::chrono::steady_clock::time_point deadline,
+           const OutputHandler &sink, ExecResult &result) {
+    ++commands_run_;
+    int code = -1;
+    if (!send(command)) {
+      result = {false, -1, false, "", "shell worker unavailable"};
+      return false;
+    }
+    switch (read_result(deadline, sink, code)) {
+      case 0: result = {true, code, false, "", ""}; return true;
+      case 4: result = {true, code, false, "", ""}; return false;
+      case 1: result = {true, -2, true, "", ""}; return false;
+      case 2: result = {false, -1, false, "", "output consumer closed"}; return false;
+      default: result = {false, -1, false, "", "shell worker exited unexpectedly"}; return false;
+    }
+  }
+
+  size_t commands_run() const { return commands_run_; }
+
+private:
+  ShellWorker() = default;
+
+  bool send(const std::string &command) {
+    std::string quoted;
+    quoted.reserve(command.size() + 16);
+    for (char c : command) {
+      if (c == '\'') {
+        quoted += "'\\''";
+      } else {
+        quoted += c;
+      }
+    }
+    return write_all("__cmd_service_c='" + quoted + "'\n"
+                     "( eval \"$__cmd_service_c\" ) </dev/null &\n"
+                     "__cmd_service_p=$!\n"
+                     "wait \"$__cmd_service_p\"\n"
+                     "__cmd_service_s=$?\n"
+                     "kill -KILL -- \"-$__cmd_service_p\" 2>/dev/null\n"
+                     "__cmd_service_p=\n"
+                     "printf '\\n%s %d\\n' '" + token_ + "' \"$__cmd_service_s\"\n");
+  }
+
+  bool write_all(const std::string &script) {
+    const char *p = script.data();
+    size_t left = script.size();
+    while (left > 0) {
+      ssize_t n = write(in_fd_, p, left);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      p += n;
+      left -= static_cast<size_t>(n);
+    }
+    return true;
+  }
+
+  // 0: finished, 1: deadline passed, 2: sink refused output, 3: worker died,
+  // 4: finished, but more output followed the marker.
+  int read_result(std::chrono::steady_clock::time_point deadline, const OutputHandler &sink,
+                  int &code) {
+    const std::string marker = "\n" + token_ + " ";
+    std::string pending;
+    char buf[4096];
+
+    while (true) {
+      size_t found = pending.find(marker);
+      if (found != std::string::npos) {
+        size_t eol = pending.find('\n', found + marker.size());
+        if (eol != std::string::npos) {
+          if (found > 0 && !sink(pending.data(), found)) return 2;
+          code = std::atoi(pending.c_str() + found + marker.size());
+          // Something outside the command's process group still writes to
+          // the pipe; it would show up in the next command's output.
+          struct pollfd pfd = {out_fd_, POLLIN, 0};
+          if (eol + 1 < pending.size() || (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))) {
+            return 4;
+          }
+          return 0;
+        }
+      } else if (pending.size() > marker.size()) {
+        // Everything but a possible partial marker at the end is output.
+        size_t ready = pending.size() - marker.size();
+        if (!sink(pending.data(), ready)) return 2;
+        pending.erase(0, ready);
+      }
+
+      int wait_ms = remaining_ms(deadline);
+      if (wait_ms <= 0) return 1;
+      struct pollfd pfd = {out_fd_, POLLIN, 0};
+      int rc = poll(&pfd, 1, wait_ms);
+      if (rc < 0 && errno != EINTR) return 3;
+      if (rc <= 0) continue;
+
+      while (true) {
+        ssize_t n = read(out_fd_, buf, sizeof(buf));
+        if (n > 0) {
+          pending.append(buf, static_cast<size_t>(n));
+          continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) return pending.find(marker) != std::string::npos ? 0 : 3;
+        break;
+      }
+    }
+  }
+
+  pid_t pid_ = -1;
+  int in_fd_ = -1;
+  int out_fd_ = -1;
+  std::string token_;
+  size_t commands_run_ = 0;
+};
+
+// Keeps `base` idle shell workers ready and starts more on demand up to
+// `max`, like ThreadPool's base and dynamic threads. Workers beyond `base`
+// stay idle for reuse and are retired once idle longer than `idle_timeout`;
+// any worker is replaced after worker_max_commands commands or after a
+// timeout or protocol failure.
+class ShellWorkerPool {
+public:
+  ShellWorkerPool(size_t base, size_t max, std::chrono::seconds idle_timeout)
+      : base_(base), max_(max), idle_timeout_(idle_timeout), reaper_([this] { reap(); }) {}
+
+  ShellWorkerPool(const ShellWorkerPool &) = delete;
+
+  ~ShellWorkerPool() {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      shutdown_ = true;
+    }
+    reaper_cond_.notify_all();
+    reaper_.join();
+  }
+
+  // Starts the base workers; returns false if none could be started.
+  bool prestart(std::string &error) {
+    for (size_t i = 0; i < base_; ++i) {
+      auto w = ShellWorker::start(error);
+      if (!w) return i > 0;
+      std::lock_guard<std::mutex> guard(mutex_);
+      idle_.push_back({std::move(w), std::chrono::steady_clock::now()});
+      ++total_;
+    }
+    return true;
+  }
+
+  ExecResult run(const std::string &command, const RunOptions &opts,
+                 const OutputHandler &on_output) {
+    auto deadline = command_deadline(opts);
+    std::unique_ptr<ShellWorker> w = acquire(deadline);
+    if (!w) return {false, -1, false, "", "no shell worker available"};
+
+    OutputBuffer output = make_output_buffer(opts);
+    size_t read_bytes = 0;
+    OutputHandler sink = [&](const char *data, size_t len) {
+      read_bytes += len;
+      if (on_output) return on_output(data, len);
+      output.append(data, len);
+      return true;
+    };
+
+    ExecResult result;
+    bool reusable;
+    {
+      ScopedTimer timer(g_metrics.child_seconds);
+      reusable = w->run(command, deadline, sink, result);
+    }
+    release(std::move(w), reusable);
+    g_metrics.output_bytes.observe(static_cast<double>(read_bytes));
+
+    if (result.ok) {
+      result.truncated = output.truncated();
+      result.output_bytes = read_bytes;  // includes output streamed to on_output
+      result.output = output.take();
+    }
+    return result;
+  }
+
+private:
+  std::unique_ptr<ShellWorker> acquire(std::chrono::steady_clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      if (!idle_.empty()) {
+        // The most recently used worker, so the rest can age out.
+        auto w = std::move(idle_.back().worker);
+        idle_.pop_back();
+        return w;
+      }
+      if (total_ < max_) {
+        ++total_;
+        lock.unlock();
+        std::string error;
+        auto w = ShellWorker::start(error, deadline);
+        if (!w) {
+          lock.lock();
+          --total_;
+          cond_.notify_one();
+        }
+        return w;
+      }
+      if (cond_.wait_until(lock, deadline) == std::cv_status::timeout && idle_.empty()) {
+        return nullptr;
+      }
+    }
+  }
+
+  void release(std::unique_ptr<ShellWorker> w, bool reusable) {
+    if (reusable && w->commands_run() < g_config.worker_max_commands) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      idle_.push_back({std::move(w), std::chrono::steady_clock::now()});
+      cond_.notify_one();
+      return;
+    }
+
+    w.reset();
+    std::lock_guard<std::mutex> guard(mutex_);
+    --total_;
+    cond_.notify_one();
+  }
+
+  // Retires workers above base_ that stayed idle past idle_timeout_, oldest
+  // first; they are at the front of idle_.
+  void reap() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!shutdown_) {
+      reaper_cond_.wait_for(lock, idle_timeout_);
+      const auto cutoff = std::chrono::steady_clock::now() - idle_timeout_;
+      std::vector<std::unique_ptr<ShellWorker>> retired;
+      while (total_ > base_ && !idle_.empty() && idle_.front().since <= cutoff) {
+        retired.push_back(std::move(idle_.front().worker));
+        idle_.pop_front();
+        --total_;
+      }
+      if (retired.empty()) continue;
+      lock.unlock();
+      retired.clear();
+      lock.lock();
+      cond_.notify_all();
+    }
+  }
+
+  struct IdleWorker {
+    std::unique_ptr<ShellWorker> worker;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  size_t base_;
+  size_t max_;
+  std::chrono::seconds idle_timeout_;
+  size_t total_ = 0;
+  std::deque<IdleWorker> idle_;  // oldest first
+  bool shutdown_ = false;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::condition_variable reaper_cond_;
+  std::thread reaper_;
+};
+
+std::unique_ptr<ShellWorkerPool> g_shell_workers;
+
+ExecResult execute_command(const std::string &command, const RunOptions &opts,
+                           const OutputHandler &on_output);
+
+// When `on_output` is set, output is handed to it chunk by chunk and
+// ExecResult::output stays empty.
+ExecResult run_command(const std::string &command, const RunOptions &opts = RunOptions(),
+                       const OutputHandler &on_output = nullptr) {
+  ExecResult r = execute_command(command, opts, on_output);
+  auto &counter = !r.ok ? g_metrics.commands_failed
+                  : r.timed_out ? g_metrics.commands_timed_out
+                                : g_metrics.commands_ok;
+  counter.fetch_add(1, std::memory_order_relaxed);
+  return r;
+}
+
+ExecResult execute_command(const std::string &command, const RunOptions &opts,
+                           const OutputHandler &on_output) {
+  const std::string trimmed = trim_copy(command);
+  std::string error;
+  if (!check_command(trimmed, error)) return {false, -1, false, "", error};
+
+  // Shell workers are long-lived, so they can't give each command a cgroup,
+  // and they have a single output pipe.
+  const bool use_cgroup = !g_config.cgroup_root.empty();
+  if (g_shell_workers && !opts.on_pipe && !use_cgroup && !opts.split_stderr) {
+    return g_shell_workers->run(trimmed, opts, on_output);
+  }
+
+  CommandCgroup cgroup;
+  if (use_cgroup && !cgroup.create(error)) return {false, -1, false, "", error};
+
+  // Stdout, and stderr too unless it is split off onto a pipe of its own.
+  int pipefd[2];
+  int errfd[2] = {-1, -1};
+  if (pipe2(pipefd, O_CLOEXEC) != 0) return {false, -1, false, "", "pipe failed"};
+  if (opts.split_stderr && pipe2(errfd, O_CLOEXEC) != 0) {
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return {false, -1, false, "", "pipe failed"};
+  }
+  for (int fd : {pipefd[0], errfd[0]}) {
+    if (fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  }
+
+  auto launched_at = std::chrono::steady_clock::now();
+  pid_t pid = launch_command(trimmed, pipefd[1], cgroup.procs_fd(), errfd[1]);
+  const double spawn_seconds = ScopedTimer::seconds_since(launched_at);
+  g_metrics.spawn_seconds.observe(spawn_seconds);
+  if (pid < 0) {
+    for (int fd : {pipefd[0], pipefd[1], errfd[0], errfd[1]}) {
+      if (fd >= 0) close(fd);
+    }
+    return {false, -1, false, "",
+            g_config.launcher == Launcher::Fork ? "fork failed" : "spawn failed"};
+  }
+
+  close(pipefd[1]);
+  if (errfd[1] >= 0) close(errfd[1]);
+
+  OutputBuffer output = make_output_buffer(opts);
+  OutputBuffer errors = make_stderr_buffer(opts);
+  size_t read_bytes = 0;
+  size_t streamed_out = 0, streamed_err = 0;  // bytes handed on rather than buffered
+  char buf[4096];
+  int status = 0;
+  bool timed_out = false;
+  bool aborted = false;
+  auto deadline = command_deadline(opts);
+
+  // Reads whatever `fd` has ready into `buffer`, or hands it to `handler`.
+  // Returns false once the pipe is at EOF. Only stdout is handed over to
+  // on_pipe.
+  auto drain = [&](int fd, OutputBuffer &buffer, const OutputHandler &handler,
+                   bool handoff) -> bool {
+    while (true) {
+      int ready = 0;
+      if (handoff && opts.on_pipe && !aborted && ioctl(fd, FIONREAD, &ready) == 0 && ready > 0) {
+        read_bytes += static_cast<size_t>(ready);
+        streamed_out += static_cast<size_t>(ready);
+        if (!opts.on_pipe(fd, static_cast<size_t>(ready))) {
+          aborted = true;
+          return false;
+        }
+        continue;
+      }
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n > 0) {
+        read_bytes += static_cast<size_t>(n);
+        if (!handler) {
+          buffer.append(buf, n);
+          continue;
+        }
+        (handoff ? streamed_out : streamed_err) += static_cast<size_t>(n);
+        if (!aborted && !handler(buf, static_cast<size_t>(n))) {
+          aborted = true;
+          return false;
+        }
+        continue;
+      }
+      if (n < 0 && errno == EINTR) continue;
+      return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+  };
+  auto drain_out = [&] { return drain(pipefd[0], output, on_output, true); };
+  auto drain_err = [&] { return drain(errfd[0], errors, opts.on_stderr, false); };
+
+  // Wait on the pipes and the child's pidfd together so output and exit are
+  // picked up as soon as they happen; the poll timeout is the deadline.
+  int pidfd = open_pidfd(pid);
+  bool out_open = true;
+  bool err_open = errfd[0] >= 0;
+
+  while (true) {
+    pid_t ret = waitpid(pid, &status, WNOHANG);
+    if (ret == pid) break;
+
+    int wait_ms = remaining_ms(deadline);
+    if (wait_ms <= 0) {
+      timed_out = true;
+      kill(pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      break;
+    }
+    // Without a pidfd, exit is only noticed by waitpid (a background grandchild
+    // may hold the pipe open), so keep the poll slice short in that case.
+    if (pidfd < 0) wait_ms = std::min(wait_ms, 10);
+
+    struct pollfd fds[3];
+    nfds_t nfds = 0;
+    int out_slot = -1, err_slot = -1;
+    if (out_open) {
+      out_slot = static_cast<int>(nfds);
+      fds[nfds++] = {pipefd[0], POLLIN, 0};
+    }
+    if (err_open) {
+      err_slot = static_cast<int>(nfds);
+      fds[nfds++] = {errfd[0], POLLIN, 0};
+    }
+    if (pidfd >= 0) fds[nfds++] = {pidfd, POLLIN, 0};
+
+    int rc = poll(fds, nfds, wait_ms);
+    if (rc < 0 && errno != EINTR) {
+      kill(pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      break;
+    }
+    if (rc > 0 && out_slot >= 0 && fds[out_slot].revents != 0) out_open = drain_out();
+    if (rc > 0 && err_slot >= 0 && fds[err_slot].revents != 0 && !aborted) {
+      err_open = drain_err();
+    }
+    if (aborted) {
+      kill(pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      break;
+    }
+  }
+
+  if (pidfd >= 0) close(pidfd);
+  if (!aborted) {
+    drain_out();
+    if (errfd[0] >= 0) drain_err();
+  }
+  close(pipefd[0]);
+  if (errfd[0] >= 0) close(errfd[0]);
+  g_metrics.child_seconds.observe(ScopedTimer::seconds_since(launched_at));
+  g_metrics.output_bytes.observe(static_cast<double>(read_bytes));
+
+  if (aborted) return {false, -1, false, "", "output consumer closed"};
+
+  int code = timed_out ? -2 : (WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+  ExecResult result{true, code, timed_out, "", ""};
+  result.truncated = output.truncated();
+  result.spawn_seconds = spawn_seconds;
+  result.output_bytes = output.total() + streamed_out;
+  result.output = output.take();
+  if (opts.split_stderr) {
+    result.split_stderr = true;
+    result.stderr_truncated = errors.truncated();
+    result.stderr_bytes = errors.total() + streamed_err;
+    result.stderr_output = errors.take();
+  }
+  if (use_cgroup) result.usage = cgroup.usage();
+  return result;
+}
+
+// Runs a login shell once and keeps the environment it ends up with, so
+// ShellMode::Snapshot children see the same PATH and variables without
+// paying for the profile scripts on every command.
+bool take_env_snapshot(std::string &error) {
+  static const std::string kMarker = std::string("\0cmd-service-env\0", 17);
+  ExecResult r = run_command("printf '\\0cmd-service-env\\0'; env -0");
+  if (!r.ok || r.exit_code != 0 || r.truncated) {
+    error = r.ok ? "env exited with " + std::to_string(r.exit_code) : r.error;
+    return false;
+  }
+  size_t pos = r.output.find(kMarker);
+  if (pos == std::string::npos) {
+    error = "no environment in shell output";
+    return false;
+  }
+
+  g_env_snapshot.clear();
+  for (const auto &entry : split_fields(r.output.substr(pos + kMarker.size()), '\0')) {
+    if (entry.find('=') != std::string::npos) g_env_snapshot.push_back(entry);
+  }
+  g_env_snapshot_ptrs.clear();
+  for (auto &entry : g_env_snapshot) g_env_snapshot_ptrs.push_back(&entry[0]);
+  g_env_snapshot_ptrs.push_back(nullptr);
+  return true;
+}
+
+// Caches results of allowlisted read-only commands (uptime, df -h, ...) for a
+// per-command TTL, evicting least recently used entries past a byte budget.
+// Identical requests that arrive while the command is running wait for that
+// run instead of starting their own.
+class ResultCache {
+public:
+  enum class Outcome { Miss, Hit, Coalesced };
+
+  explicit ResultCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  void allow(const std::string &command, std::chrono::milliseconds ttl) {
+    allowlist_[command] = ttl;
+  }
+
+  bool enabled() const { return !allowlist_.empty() && max_bytes_ > 0; }
+
+  bool cacheable(const std::string &command) const { return allowlist_.count(command) > 0; }
+
+  ExecResult get_or_run(const std::string &command, const std::function<ExecResult()> &run,
+                        Outcome &outcome) {
+    std::shared_future<ExecResult> pending;
+    std::promise<ExecResult> promise;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto it = entries_.find(command);
+      if (it != entries_.end()) {
+        if (std::chrono::steady_clock::now() < it->second->expires_at) {
+          lru_.splice(lru_.begin(), lru_, it->second);
+          outcome = Outcome::Hit;
+          return it->second->result;
+        }
+        erase(it);
+      }
+
+      auto flight = in_flight_.find(command);
+      if (flight != in_flight_.end()) {
+        pending = flight->second;
+      } else {
+        in_flight_[command] = promise.get_future().share();
+      }
+    }
+
+    if (pending.valid()) {
+      outcome = Outcome::Coalesced;
+      return pending.get();
+    }
+
+    outcome = Outcome::Miss;
+    ExecResult r;
+    try {
+      r = run();
+    } catch (...) {
+      // Waiters get the same exception, and the next request runs afresh.
+      {
+        std::lock_guard<std::mutex> guard(mutex_);
+        in_flight_.erase(command);
+      }
+      promise.set_exception(std::current_exception());
+      throw;
+    }
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      in_flight_.erase(command);
+      if (r.ok && !r.timed_out) insert(command, r);
+    }
+    promise.set_value(r);
+    return r;
+  }
+
+private:
+  struct Entry {
+    std::string command;
+    ExecResult result;
+    size_t bytes;
+    std::chrono::steady_clock::time_point expires_at;
+  };
+  using EntryList = std::list<Entry>;
+
+  // Caller holds mutex_.
+  void insert(const std::string &command, const ExecResult &r) {
+    size_t bytes = command.size() * 2 + r.output.size() + r.error.size() + sizeof(Entry);
+    if (bytes > max_bytes_) return;
+    auto ttl = allowlist_.at(command);
+    lru_.push_front({command, r, bytes, std::chrono::steady_clock::now() + ttl});
+    entries_[command] = lru_.begin();
+    bytes_ += bytes;
+    while (bytes_ > max_bytes_) erase(entries_.find(lru_.back().command));
+  }
+
+  void erase(std::unordered_map<std::string, EntryList::iterator>::iterator it) {
+    bytes_ -= it->second->bytes;
+    lru_.erase(it->second);
+    entries_.erase(it);
+  }
+
+  size_t max_bytes_;
+  size_t bytes_ = 0;
+  std::unordered_map<std::string, std::chrono::milliseconds> allowlist_;
+  EntryList lru_;
+  std::unordered_map<std::string, EntryList::iterator> entries_;
+  std::unordered_map<std::string, std::shared_future<ExecResult>> in_flight_;
+  std::mutex mutex_;
+};
+
+// Allowlist file, one command per line: ttl_ms<TAB>command. The command must
+// match the request body exactly after trimming and JSON-string decoding.
+bool load_cache_rules(ResultCache &cache, const std::string &path, std::string &error) {
+  std::ifstream in(path);
+  if (!in) {
+    error = "cannot open " + path;
+    return false;
+  }
+
+  std::string line;
+  size_t lineno = 0;
+  while (std::getline(in, line)) {
+    ++lineno;
+    if (trim_copy(line).empty() || trim_copy(line)[0] == '#') continue;
+
+    size_t tab = line.find('\t');
+    char *end = nullptr;
+    long ttl = tab == std::string::npos ? 0 : std::strtol(line.c_str(), &end, 10);
+    std::string command = tab == std::string::npos ? "" : trim_copy(line.substr(tab + 1));
+    if (ttl <= 0 || end != line.c_str() + tab || command.empty()) {
+      error = path + ":" + std::to_string(lineno) + ": expected ttl_ms<TAB>command";
+      return false;
+    }
+    cache.allow(command, std::chrono::milliseconds(ttl));
+  }
+  return true;
+}
+
+// Admission control for commands started over HTTP. At most `limit` run at
+// once; up to `queue_max` more wait, each for at most `queue_wait`, and
+// anything past that is turned away at once so the client can back off
+// (503 + Retry-After) instead of piling up in the HTTP pool.
+//
+// With `adaptive`, the limit moves between 1 and `max_limit` following the
+// gradient of command latency (as in Netflix's Gradient2): the slow average
+// over the fast one shrinks the limit when latency rises with concurrency,
+// and a sqrt(limit) allowance lets it grow while latency stays flat.
+class AdmissionControl {
+public:
+  enum class Outcome { Admitted, QueueFull, QueueTimeout };
+
+  // Holds one slot until destroyed; the time it was held feeds the limit.
+  class Ticket {
+  public:
+    explicit Ticket(AdmissionControl &owner)
+        : owner_(owner), start_(std::chrono::steady_clock::now()) {}
+    Ticket(const Ticket &) = delete;
+    ~Ticket() { owner_.release(ScopedTimer::seconds_since(start_)); }
+
+  private:
+    AdmissionControl &owner_;
+    std::chrono::steady_clock::time_point start_;
+  };
+
+  AdmissionControl(size_t max_limit, size_t queue_max, std::chrono::milliseconds queue_wait,
+                   bool adaptive)
+      : max_limit_(static_cast<double>(max_limit)), queue_max_(queue_max),
+        queue_wait_(queue_wait), adaptive_(adaptive), limit_(max_limit_) {}
+
+  Outcome admit(std::unique_ptr<Ticket> &ticket) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (in_flight_ >= limit() || waiting_ > 0) {
+      if (waiting_ >= queue_max_) {
+        ++rejected_full_;
+        return Outcome::QueueFull;
+      }
+      ++waiting_;
+      bool admitted = cond_.wait_for(lock, queue_wait_, [&] { return in_flight_ < limit(); });
+      --waiting_;
+      if (!admitted) {
+        ++rejected_timeout_;
+        return Outcome::QueueTimeout;
+      }
+    }
+    ++in_flight_;
+    lock.unlock();
+    ticket.reset(new Ticket(*this));
+    return Outcome::Admitted;
+  }
+
+  // Seconds a turned-away client should wait: the queue ahead of it, drained
+  // `limit` at a time at the recent average latency.
+  int retry_after() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    double waves = static_cast<double>(waiting_ + 1) / static_cast<double>(limit());
+    return std::max(1, static_cast<int>(std::ceil(waves * short_rtt_)));
+  }
+
+  struct Stats {
+    size_t limit, in_flight, waiting;
+    uint64_t rejected_full, rejected_timeout;
+  };
+  Stats stats() {
+    std::lock_guard<std::mutex> guard(mutex_);
+    return {limit(), in_flight_, waiting_, rejected_full_, rejected_timeout_};
+  }
+
+private:
+  // Caller holds mutex_.
+  size_t limit() const { return static_cast<size_t>(limit_); }
+
+  void release(double seconds) {
+    bool grew = false;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      size_t before = limit();
+      --in_flight_;
+      short_rtt_ = samples_ == 0 ? seconds : short_rtt_ * 0.9 + seconds * 0.1;
+      long_rtt_ = samples_ == 0 ? seconds : long_rtt_ * 0.99 + seconds * 0.01;
+      ++samples_;
+      if (adaptive_ && samples_ >= 10) {
+        double gradient = std::max(0.5, std::min(1.0, long_rtt_ / std::max(short_rtt_, 1e-6)));
+        double next = limit_ * gradient + std::sqrt(limit_);
+        limit_ = std::max(1.0, std::min(max_limit_, limit_ * 0.8 + next * 0.2));
+      }
+      grew = limit() > before;
+    }
+    if (grew) {
+      cond_.notify_all();
+    } else {
+      cond_.notify_one();
+    }
+  }
+
+  const double max_limit_;
+  const size_t queue_max_;
+  const std::chrono::milliseconds queue_wait_;
+  const bool adaptive_;
+  double limit_;
+  double short_rtt_ = 0;
+  double long_rtt_ = 0;
+  uint64_t samples_ = 0;
+  size_t in_flight_ = 0;
+  size_t waiting_ = 0;
+  uint64_t rejected_full_ = 0;
+  uint64_t rejected_timeout_ = 0;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
+std::unique_ptr<AdmissionControl> g_admission;
+
+// Runs submitted commands on its own worker threads so slow commands never
+// hold an HTTP worker. Higher priority runs first; equal priorities run in
+// submission order. Finished jobs are kept for job_retention_sec.
+class JobScheduler {
+public:
+  enum class State { Queued, Running, Done };
+
+  struct Job {
+    std::string id;
+    std::string command;
+    int priority = 0;
+    RunOptions opts;
+    State state = State::Queued;
+    ExecResult result{false, -1, false, "", ""};
+    std::chrono::steady_clock::time_point finished_at;
+  };
+
+  JobScheduler(size_t workers, size_t queue_max) : queue_max_(queue_max) {
+    for (size_t i = 0; i < workers; ++i) threads_.emplace_back([this] { worker(); });
+  }
+
+  JobScheduler(const JobScheduler &) = delete;
+
+  ~JobScheduler() {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      shutdown_ = true;
+    }
+    queue_cond_.notify_all();
+    for (auto &t : threads_) t.join();
+  }
+
+  // Returns an empty id when the queue is full.
+  std::string submit(const std::string &command, int priority, const RunOptions &opts) {
+    std::lock_guard<std::mutex> guard(mutex_);
+    prune_finished();
+    if (queue_.size() >= queue_max_) return "";
+
+    auto job = std::make_shared<Job>();
+    job->id = std::to_string(++next_id_);
+    job->command = command;
+    job->priority = priority;
+    job->opts = opts;
+    jobs_[job->id] = job;
+    queue_.push({priority, next_id_, job});
+    queue_cond_.notify_one();
+    return job->id;
+  }
+
+  // Copies the job out, waiting up to `wait` for it to finish. Returns false
+  // for unknown (or already pruned) ids.
+  bool get(const std::string &id, std::chrono::milliseconds wait, Job &out) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) return false;
+    std::shared_ptr<Job> job = it->second;
+    if (wait.count() > 0) {
+      done_cond_.wait_for(lock, wait, [&] { return job->state == State::Done || shutdown_; });
+    }
+    out = *job;
+    return true;
+  }
+
+  static const char *state_name(State state) {
+    switch (state) {
+      case State::Queued: return "queued";
+      case State::Running: return "running";
+      case State::Done: return "done";
+    }
+    return "unknown";
+  }
+
+private:
+  struct Entry {
+    int priority;
+    uint64_t seq;
+    std::shared_ptr<Job> job;
+
+    bool operator<(const Entry &other) const {
+      if (priority != other.priority) return priority < other.priority;
+      return seq > other.seq;
+    }
+  };
+
+  void worker() {
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        queue_cond_.wait(lock, [&] { return !queue_.empty() || shutdown_; });
+        if (shutdown_) return;
+        job = queue_.top().job;
+        queue_.pop();
+        job->state = State::Running;
+      }
+
+      ExecResult r = run_command(job->command, job->opts);
+
+      {
+        std::lock_guard<std::mutex> guard(mutex_);
+        job->result = std::move(r);
+        job->state = State::Done;
+        job->finished_at = std::chrono::steady_clock::now();
+      }
+      done_cond_.notify_all();
+    }
+  }
+
+  // Caller holds mutex_.
+  void prune_finished() {
+    auto cutoff = std::chrono::steady_clock::now() -
+                  std::chrono::seconds(g_config.job_retention_sec);
+    for (auto it = jobs_.begin(); it != jobs_.end();) {
+      if (it->second->state == State::Done && it->second->finished_at < cutoff) {
+        it = jobs_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  size_t queue_max_;
+  bool shutdown_ = false;
+  uint64_t next_id_ = 0;
+  std::priority_queue<Entry> queue_;
+  std::map<std::string, std::shared_ptr<Job>> jobs_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable queue_cond_;
+  std::condition_variable done_cond_;
+};
+
+// SHA-256 (FIPS 180-4). Keyring entries are kept as digests only.
+std::array<uint8_t, 32> sha256(const void *data, size_t len) {
+  static const uint32_t k[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+      0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+      0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+      0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+      0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+      0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+      0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+      0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+      0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+      0xc67178f2};
+  uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+
+  // The message plus 0x80, zero padding and the 64-bit bit length.
+  const uint8_t *msg = static_cast<const uint8_t *>(data);
+  size_t padded = ((len + 8) / 64 + 1) * 64;
+  uint8_t block[64];
+  for (size_t off = 0; off < padded; off += 64) {
+    for (size_t i = 0; i < 64; ++i) {
+      size_t pos = off + i;
+      if (pos < len) {
+        block[i] = msg[pos];
+      } else if (pos == len) {
+        block[i] = 0x80;
+      } else if (pos >= padded - 8) {
+        uint64_t bits = static_cast<uint64_t>(len) * 8;
+        block[i] = static_cast<uint8_t>(bits >> (8 * (padded - 1 - pos)));
+      } else {
+        block[i] = 0;
+      }
+    }
+
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = uint32_t(block[i * 4]) << 24 | uint32_t(block[i * 4 + 1]) << 16 |
+             uint32_t(block[i * 4 + 2]) << 8 | uint32_t(block[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t t1 =
+          hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+      uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      hh = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e, h[5] += f, h[6] += g, h[7] += hh;
+  }
+
+  std::array<uint8_t, 32> out;
+  for (int i = 0; i < 8; ++i) {
+    for (int j = 0; j < 4; ++j) out[i * 4 + j] = static_cast<uint8_t>(h[i] >> (24 - 8 * j));
+  }
+  return out;
+}
+
+// Token bucket in its GCRA form: the whole state is one atomic "theoretical
+// arrival time", advanced by one interval per accepted request with a CAS,
+// so concurrent requests on the same key never take a lock.
+class RateLimiter {
+public:
+  RateLimiter(double rate, double burst)
+      : interval_ns_(static_cast<int64_t>(1e9 / rate)),
+        tolerance_ns_(static_cast<int64_t>(1e9 / rate * (std::max(1.0, burst) - 1))) {}
+
+  // 0 when the request may go ahead, otherwise nanoseconds until it could.
+  int64_t acquire() {
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count();
+    int64_t tat = tat_.load(std::memory_order_relaxed);
+    while (true) {
+      int64_t base = std::max(tat, now);
+      if (base - now > tolerance_ns_) return base - now - tolerance_ns_;
+      if (tat_.compare_exchange_weak(tat, base + interval_ns_, std::memory_order_relaxed)) {
+        return 0;
+      }
+    }
+  }
+
+  bool same_limits(const RateLimiter &other) const {
+    return interval_ns_ == other.interval_ns_ && tolerance_ns_ == other.tolerance_ns_;
+  }
+
+private:
+  const int64_t interval_ns_;
+  const int64_t tolerance_ns_;
+  std::atomic<int64_t> tat_{0};
+};
+
+// Bearer tokens the service accepts. Each key is stored as its SHA-256
+// digest, and verify() compares the presented token's digest against every
+// key without exiting early, so timing reveals neither which key nor how
+// much of one matched.
+class Keyring {
+public:
+  struct Key {
+    std::string name;
+    std::array<uint8_t, 32> digest;
+    std::shared_ptr<RateLimiter> limiter;  // null: unlimited
+  };
+
+  // One key per line: `name token [rate_per_sec [burst]]`. The token may be
+  // given as `sha256:<hex digest>` so the file never holds it in the clear.
+  // `previous` hands its rate limiters on to same-named keys with unchanged
+  // limits, so a reload doesn't refill everyone's bucket.
+  static std::unique_ptr<Keyring> load(const std::string &path, const char *env_token,
+                                       const Keyring *previous, std::string &error) {
+    std::unique_ptr<Keyring> ring(new Keyring());
+    if (env_token && *env_token) {
+      ring->keys_.push_back({"default", sha256(env_token, std::strlen(env_token)), nullptr});
+    }
+    if (path.empty()) return ring;
+
+    std::ifstream in(path);
+    if (!in) {
+      error = "cannot open " + path;
+      return nullptr;
+    }
+    std::string line;
+    for (size_t lineno = 1; std::getline(in, line); ++lineno) {
+      line = trim_copy(line);
+      if (line.empty() || line[0] == '#') continue;
+
+      std::istringstream fields(line);
+      Key key;
+      std::string token, rate_field, burst_field, extra;
+      fields >> key.name >> token >> rate_field >> burst_field >> extra;
+      double rate = 0, burst = 0;
+      if (token.empty() || !extra.empty() || !parse_rate(rate_field, rate) ||
+          !parse_rate(burst_field, burst)) {
+        error = path + ":" + std::to_string(lineno) + ": expected `name token [rate [burst]]`";
+        return nullptr;
+      }
+
+      if (token.rfind("sha256:", 0) == 0) {
+        if (!parse_digest(token.substr(7), key.digest)) {
+          error = path + ":" + std::to_string(lineno) + ": bad sha256 digest";
+          return nullptr;
+        }
+      } else {
+        key.digest = sha256(token.data(), token.size());
+      }
+
+      if (rate > 0) {
+        key.limiter = std::make_shared<RateLimiter>(rate, burst > 0 ? burst : rate);
+        const Key *old = previous ? previous->find_name(key.name) : nullptr;
+        if (old && old->limiter && old->limiter->same_limits(*key.limiter)) {
+          key.limiter = old->limiter;
+        }
+      }
+      ring->keys_.push_back(std::move(key));
+    }
+    return ring;
+  }
+
+  // The key `token` belongs to, or null.
+  const Key *verify(std::string_view token) const {
+    std::array<uint8_t, 32> digest = sha256(token.data(), token.size());
+    const Key *match = nullptr;
+    for (const Key &key : keys_) {
+      uint8_t diff = 0;
+      for (size_t i = 0; i < digest.size(); ++i) diff |= digest[i] ^ key.digest[i];
+      if (diff == 0 && !match) match = &key;
+    }
+    return match;
+  }
+
+  size_t size() const { return keys_.size(); }
+
+private:
+  Keyring() = default;
+
+  // Empty means unset (0); anything else must be a non-negative number.
+  static bool parse_rate(const std::string &field, double &out) {
+    if (field.empty()) return true;
+    char *end = nullptr;
+    out = std::strtod(field.c_str(), &end);
+    return *end == '\0' && out >= 0;
+  }
+
+  static bool parse_digest(const std::string &hex, std::array<uint8_t, 32> &out) {
+    if (hex.size() != 64) return false;
+    for (size_t i = 0; i < 32; ++i) {
+      unsigned value = 0;
+      auto r = std::from_chars(hex.data() + i * 2, hex.data() + i * 2 + 2, value, 16);
+      if (r.ec != std::errc() || r.ptr != hex.data() + i * 2 + 2) return false;
+      out[i] = static_cast<uint8_t>(value);
+    }
+    return true;
+  }
+
+  const Key *find_name(const std::string &name) const {
+    for (const Key &key : keys_) {
+      if (key.name == name) return &key;
+    }
+    return nullptr;
+  }
+
+  std::vector<Key> keys_;
+};
+
+// Requests read the current keyring through a plain atomic pointer. Replaced
+// keyrings are kept rather than freed, since a request may still be using
+// one; reloads are rare and a keyring is small.
+std::atomic<const Keyring *> g_keyring{nullptr};
+std::vector<std::unique_ptr<Keyring>> g_keyrings;
+std::mutex g_keyrings_mutex;
+
+bool reload_keyring(std::string &error) {
+  std::lock_guard<std::mutex> guard(g_keyrings_mutex);
+  std::unique_ptr<Keyring> ring =
+      Keyring::load(env_or("CMD_SERVICE_KEYRING", ""), std::getenv("CMD_SERVICE_TOKEN"),
+                    g_keyring.load(), error);
+  if (!ring) return false;
+  g_keyring.store(ring.get(), std::memory_order_release);
+  g_keyrings.push_back(std::move(ring));
+  return true;
+}
+
+// Set by begin_drain(); /health reports it so balancers stop routing here.
+std::atomic<bool> g_draining{false};
+std::atomic<httplib::Server *> g_server{nullptr};
+
+// Stops accepting and lets the requests being served finish, commands
+// included; listen() returns once they have. Whatever is still running after
+// drain_sec is cut off by exiting.
+void begin_drain(const char *reason) {
+  if (g_draining.exchange(true)) return;
+  std::cerr << "draining (" << reason << "), up to " << g_config.drain_sec << "s\n";
+  if (httplib::Server *svr = g_server.load()) svr->release_listen_sockets();
+  std::thread([] {
+    std::this_thread::sleep_for(std::chrono::seconds(g_config.drain_sec));
+    std::cerr << "drain deadline reached, exiting with requests in flight\n";
+    std::_Exit(1);
+  }).detach();
+}
+
+// SIGHUP reloads the keyring (when one is configured); SIGTERM and SIGINT
+// drain, and a second one exits at once. The handler only writes the signal
+// number to a pipe; a thread of its own does the rest.
+int g_signal_pipe[2] = {-1, -1};
+
+void start_signal_thread(bool reload_on_hup) {
+  if (pipe2(g_signal_pipe, O_CLOEXEC) != 0) return;
+  struct sigaction sa;
+  std::memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = [](int sig) {
+    int saved = errno;
+    char c = static_cast<char>(sig);
+    ssize_t n = write(g_signal_pipe[1], &c, 1);
+    (void)n;
+    errno = saved;
+  };
+  sa.sa_flags = SA_RESTART;
+  if (reload_on_hup) sigaction(SIGHUP, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+  sigaction(SIGINT, &sa, nullptr);
+
+  std::thread([] {
+    char c;
+    while (true) {
+      ssize_t n = read(g_signal_pipe[0], &c, 1);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return;
+      if (c != SIGHUP) {
+        if (g_draining) std::_Exit(1);
+        begin_drain(c == SIGTERM ? "SIGTERM" : "SIGINT");
+        continue;
+      }
+      std::string error;
+      if (reload_keyring(error)) {
+        std::cerr << "keyring reloaded: " << g_keyring.load()->size() << " keys\n";
+      } else {
+        std::cerr << "keyring reload failed (" << error << "), keeping the current keys\n";
+      }
+    }
+  }).detach();
+}
+
+// At most this many listening sockets are taken from systemd or a
+// predecessor.
+const size_t kMaxHandoffFds = 64;
+
+bool is_listening_socket(int fd) {
+  int listening = 0;
+  socklen_t len = sizeof(listening);
+  return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 && listening;
+}
+
+// Sockets passed by systemd socket activation: LISTEN_FDS of them from fd 3,
+// meant for this process if LISTEN_PID matches. Only listening sockets are
+// taken, up to kMaxHandoffFds. Clears the variables so commands don't see
+// them.
+std::vector<int> systemd_listen_fds() {
+  std::vector<int> fds;
+  const char *pid = std::getenv("LISTEN_PID");
+  const char *count = std::getenv("LISTEN_FDS");
+  if (pid && count && std::strtol(pid, nullptr, 10) == getpid()) {
+    long n = std::strtol(count, nullptr, 10);
+    if (n < 0 || static_cast<size_t>(n) > kMaxHandoffFds) {
+      std::cerr << "LISTEN_FDS=" << count << ", using at most " << kMaxHandoffFds << "\n";
+      n = std::max(0L, std::min(n, static_cast<long>(kMaxHandoffFds)));
+    }
+    for (int fd = 3; fd < 3 + n; ++fd) {
+      if (!is_listening_socket(fd)) continue;
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      fds.push_back(fd);
+    }
+    if (fds.size() < static_cast<size_t>(n)) {
+      std::cerr << "LISTEN_FDS: " << n - static_cast<long>(fds.size())
+                << " fds are not listening sockets, skipped\n";
+    }
+  }
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  return fds;
+}
+
+// Hot restart: the serving process listens on a unix socket; a new process
+// connects, gets the listening sockets as SCM_RIGHTS and acknowledges with a
+// byte once it is ready to accept, and the old one then drains. Connections
+// are never refused in between: both processes hold the same sockets, and
+// what neither accepts yet waits in the backlog.
+
+bool unix_address(const std::string &path, sockaddr_un &addr) {
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path)) return false;
+  std::memcpy(addr.sun_path, path.data(), path.size());
+  return true;
+}
+
+bool send_fds(int sock, const std::vector<int> &fds) {
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxHandoffFds)];
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+  std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+bool recv_fds(int sock, std::vector<int> &fds) {
+  char byte;
+  struct iovec iov = {&byte, 1};
+  alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxHandoffFds)];
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) return false;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+    const size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const size_t first = fds.size();
+    fds.resize(first + n);
+    std::memcpy(&fds[first], CMSG_DATA(cmsg), n * sizeof(int));
+  }
+  return !fds.empty();
+}
+
+// Asks the process serving on `path` for its listening sockets. Returns the
+// connection to acknowledge on, or -1 when there is no such process (a cold
+// start) or the handoff failed.
+int request_handoff(const std::string &path, std::vector<int> &fds) {
+  sockaddr_un addr;
+  if (!unix_address(path, addr)) return -1;
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) return -1;
+  struct timeval tv = {5, 0};
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+    close(sock);
+    return -1;
+  }
+  const bool received = recv_fds(sock, fds);
+  if (!received || !std::all_of(fds.begin(), fds.end(), is_listening_socket)) {
+    std::cerr << "no listening sockets from the process on " << path << ", binding\n";
+    for (int fd : fds) close(fd);
+    fds.clear();
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// Serves handoff requests from processes of the same user until one succeeds,
+// then drains. A failed handoff leaves this process serving.
+bool start_handoff_listener(const std::string &path, std::string &error) {
+  sockaddr_un addr;
+  if (!unix_address(path, addr)) {
+    error = "path too long";
+    return false;
+  }
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    error = std::strerror(errno);
+    return false;
+  }
+  unlink(path.c_str());
+  if (bind(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+      chmod(path.c_str(), 0600) != 0 || listen(sock, 4) != 0) {
+    error = std::strerror(errno);
+    close(sock);
+    return false;
+  }
+
+  std::thread([sock] {
+    while (!g_draining) {
+      int conn = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+      if (conn < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        break;
+      }
+      struct ucred peer;
+      socklen_t len = sizeof(peer);
+      bool ok = getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &len) == 0 &&
+                peer.uid == getuid();
+      // The successor acknowledges once it is ready to accept.
+      struct timeval tv = {10, 0};
+      setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      std::vector<int> fds = g_server.load()->listen_sockets();
+      char ack;
+      ok = ok && !fds.empty() && fds.size() <= kMaxHandoffFds && send_fds(conn, fds) &&
+           read(conn, &ack, 1) == 1;
+      close(conn);
+      if (ok) {
+        begin_drain("handed over to a new process");
+        break;
+      }
+      std::cerr << "listening socket handoff failed, still serving\n";
+    }
+    close(sock);
+  }).detach();
+  return true;
+}
+
+// "Bearer <token>" or a bare token, trimmed, as a view into the header.
+std::string_view parse_authorization(std::string_view value) {
+  auto is_space = [](char c) { return std::isspace(static_cast<unsigned char>(c)) != 0; };
+  while (!value.empty() && is_space(value.front())) value.remove_prefix(1);
+  while (!value.empty() && is_space(value.back())) value.remove_suffix(1);
+  static const char prefix[] = "bearer ";
+  const size_t n = sizeof(prefix) - 1;
+  if (value.size() >= n &&
+      std::equal(value.begin(), value.begin() + n, prefix, [](char a, char b) {
+        return std::tolower(static_cast<unsigned char>(a)) == b;
+      })) {
+    value.remove_prefix(n);
+    while (!value.empty() && is_space(value.front())) value.remove_prefix(1);
+  }
+  return value;
+}
+
+// One access log line, fixed-size so it can sit in the ring buffer without
+// allocating. The path is cut at sizeof(path) - 1 bytes.
+struct AccessRecord {
+  std::chrono::steady_clock::time_point started{};
+  int64_t unix_usec = 0;
+  char method[8] = {};
+  char path[112] = {};
+  int status = 0;
+  bool begun = false;
+  bool deferred = false;  // a streamed response, logged when its provider returns
+  bool has_command = false;
+  bool has_result = false;
+  bool timed_out = false;
+  uint8_t command_hash[8] = {};  // the first bytes of the command's sha256
+  int exit_code = 0;
+  uint64_t output_bytes = 0;  // what the command printed
+  uint64_t bytes_out = 0;     // response body
+  uint32_t spawn_usec = 0;
+  uint32_t total_usec = 0;
+
+  void begin(const std::string &m, const std::string &p) {
+    *this = AccessRecord();
+    begun = true;
+    started = std::chrono::steady_clock::now();
+    unix_usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+    copy_field(method, sizeof(method), m);
+    copy_field(path, sizeof(path), p);
+  }
+
+  void set_command(const std::string &command) {
+    std::array<uint8_t, 32> digest = sha256(command.data(), command.size());
+    std::memcpy(command_hash, digest.data(), sizeof(command_hash));
+    has_command = true;
+  }
+
+  void set_result(const ExecResult &r) {
+    if (!r.ok) return;
+    has_result = true;
+    exit_code = r.exit_code;
+    timed_out = r.timed_out;
+    output_bytes = r.output_bytes;
+    spawn_usec = static_cast<uint32_t>(r.spawn_seconds * 1e6);
+  }
+
+  void finish(int code, uint64_t bytes) {
+    status = code;
+    bytes_out = bytes;
+    total_usec = static_cast<uint32_t>(std::min<double>(
+        ScopedTimer::seconds_since(started) * 1e6, std::numeric_limits<uint32_t>::max()));
+  }
+
+private:
+  static void copy_field(char *out, size_t size, const std::string &value) {
+    size_t n = std::min(value.size(), size - 1);
+    std::memcpy(out, value.data(), n);
+    out[n] = '\0';
+  }
+};
+
+// Request log that stays off the request path: workers push fixed-size
+// records into a bounded lock-free ring (multi-producer, one consumer), and a
+// thread of its own formats them as JSON lines and writes them in batches.
+// A full ring drops the record and counts it rather than waiting; the file
+// gets a line with the running total after drops.
+class AccessLog {
+public:
+  static std::unique_ptr<AccessLog> open(const std::string &path, size_t capacity,
+                                         size_t max_bytes, size_t keep, std::string &error) {
+    if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+      error = "buffer size must be a power of two";
+      return nullptr;
+    }
+    std::unique_ptr<AccessLog> log(new AccessLog(path, capacity, max_bytes, keep));
+    if (!log->reopen()) {
+      error = path + ": " + std::strerror(errno);
+      return nullptr;
+    }
+    log->thread_ = std::thread([p = log.get()] { p->writer(); });
+    return log;
+  }
+
+  AccessLog(const AccessLog &) = delete;
+
+  // Writes out whatever is still queued.
+  ~AccessLog() {
+    stop_.store(true, std::memory_order_release);
+    if (thread_.joinable()) thread_.join();
+    if (fd_ >= 0) close(fd_);
+  }
+
+  bool push(const AccessRecord &rec) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Slot &slot = slots_[pos & mask_];
+      size_t seq = slot.seq.load(std::memory_order_acquire);
+      auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          slot.rec = rec;
+          slot.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  uint64_t written() const { return written_.load(std::memory_order_relaxed); }
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  struct Slot {
+    std::atomic<size_t> seq{0};
+    AccessRecord rec;
+  };
+
+  static const size_t kBatch = 512;
+
+  AccessLog(const std::string &path, size_t capacity, size_t max_bytes, size_t keep)
+      : path_(path), max_bytes_(max_bytes), keep_(keep), mask_(capacity - 1),
+        slots_(new Slot[capacity]) {
+    for (size_t i = 0; i < capacity; ++i) slots_[i].seq.store(i, std::memory_order_relaxed);
+  }
+
+  // Only the writer thread pops.
+  bool pop(AccessRecord &rec) {
+    Slot &slot = slots_[tail_ & mask_];
+    if (slot.seq.load(std::memory_order_acquire) != tail_ + 1) return false;
+    rec = slot.rec;
+    slot.seq.store(tail_ + mask_ + 1, std::memory_order_release);
+    ++tail_;
+    return true;
+  }
+
+  void writer() {
+    std::string batch;
+    AccessRecord rec;
+    uint64_t dropped_reported = 0;
+    while (true) {
+      // Read before draining, so records pushed before the destructor ran
+      // are all written.
+      const bool stopping = stop_.load(std::memory_order_acquire);
+      size_t n = 0;
+      while (n < kBatch && pop(rec)) {
+        format(rec, batch);
+        ++n;
+      }
+      const uint64_t dropped = this->dropped();
+      if (dropped != dropped_reported) {
+        JsonWriter w(batch);
+        w.str("event", "dropped").num("dropped_total", static_cast<long long>(dropped));
+        w.close();
+        batch += '\n';
+        dropped_reported = dropped;
+      }
+      if (!batch.empty()) {
+        write_batch(batch);
+        written_.fetch_add(n, std::memory_order_relaxed);
+        batch.clear();
+      }
+      if (n == kBatch) continue;
+      if (stopping) return;
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+  }
+
+  static void format(const AccessRecord &rec, std::string &out) {
+    char time[40];
+    const time_t secs = static_cast<time_t>(rec.unix_usec / 1000000);
+    struct tm tm;
+    gmtime_r(&secs, &tm);
+    size_t n = std::strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &tm);
+    std::snprintf(time + n, sizeof(time) - n, ".%06dZ",
+                  static_cast<int>(rec.unix_usec % 1000000));
+
+    JsonWriter w(out);
+    w.str("time", time, std::strlen(time))
+        .str("method", rec.method, std::strlen(rec.method))
+        .str("path", rec.path, std::strlen(rec.path))
+        .num("status", rec.status);
+    if (rec.has_command) {
+      static const char kHex[] = "0123456789abcdef";
+      char hex[2 * sizeof(rec.command_hash)];
+      for (size_t i = 0; i < sizeof(rec.command_hash); ++i) {
+        hex[2 * i] = kHex[rec.command_hash[i] >> 4];
+        hex[2 * i + 1] = kHex[rec.command_hash[i] & 0xf];
+      }
+      w.str("command_hash", hex, sizeof(hex));
+    }
+    if (rec.has_result) {
+      w.num("exit_code", rec.exit_code)
+          .boolean("timed_out", rec.timed_out)
+          .num("output_bytes", static_cast<long long>(rec.output_bytes))
+          .num("spawn_us", rec.spawn_usec);
+    }
+    w.num("bytes_out", static_cast<long long>(rec.bytes_out)).num("total_us", rec.total_usec);
+    w.close();
+    out += '\n';
+  }
+
+  void write_batch(const std::string &batch) {
+    if (max_bytes_ > 0 && size_ > 0 && size_ + batch.size() > max_bytes_) rotate();
+    if (fd_ < 0) return;
+    const char *p = batch.data();
+    size_t left = batch.size();
+    while (left > 0) {
+      ssize_t n = write(fd_, p, left);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        std::cerr << "access log write failed: " << std::strerror(errno) << "\n";
+        return;
+      }
+      p += n;
+      left -= static_cast<size_t>(n);
+      size_ += static_cast<size_t>(n);
+    }
+  }
+
+  // path -> path.1 -> ... -> path.<keep>; the oldest falls off.
+  void rotate() {
+    close(fd_);
+    fd_ = -1;
+    if (keep_ == 0) {
+      unlink(path_.c_str());
+    } else {
+      for (size_t i = keep_; i > 1; --i) {
+        rename((path_ + "." + std::to_string(i - 1)).c_str(),
+               (path_ + "." + std::to_string(i)).c_str());
+      }
+      rename(path_.c_str(), (path_ + ".1").c_str());
+    }
+    if (!reopen()) {
+      std::cerr << "access log reopen failed: " << std::strerror(errno) << "\n";
+    }
+  }
+
+  bool reopen() {
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+    if (fd_ < 0) return false;
+    struct stat st;
+    size_ = fstat(fd_, &st) == 0 ? static_cast<size_t>(st.st_size) : 0;
+    return true;
+  }
+
+  std::string path_;
+  size_t max_bytes_;
+  size_t keep_;
+  size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) size_t tail_ = 0;
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> written_{0};
+  std::atomic<bool> stop_{false};
+  int fd_ = -1;
+  size_t size_ = 0;
+  std::thread thread_;
+};
+
+std::unique_ptr<AccessLog> g_access_log;
+
+// Streamed responses go out after post-routing has run, so their content
+// provider logs them instead: this pushes the record when it goes out of
+// scope, however the provider returns.
+struct StreamAccess {
+  explicit StreamAccess(const AccessRecord &rec) : record(rec) {}
+  ~StreamAccess() {
+    if (!g_access_log) return;
+    record.finish(200, bytes_out);
+    g_access_log->push(record);
+  }
+
+  AccessRecord record;
+  uint64_t bytes_out = 0;
+};
+
+// Runs the commands of one /run/batch request on up to `parallel` threads of
+// its own and hands the results back one at a time, in input order or as
+// they finish. Every command shares opts.deadline; commands not started by
+// then are skipped.
+class BatchRun {
+public:
+  BatchRun(std::vector<std::string> commands, size_t parallel, bool ordered,
+           const RunOptions &opts)
+      : commands_(std::move(commands)), ordered_(ordered), opts_(opts),
+        results_(commands_.size()), ready_(commands_.size(), false) {
+    parallel = std::min(parallel, commands_.size());
+    for (size_t i = 0; i < parallel; ++i) threads_.emplace_back([this] { worker(); });
+  }
+
+  BatchRun(const BatchRun &) = delete;
+
+  // Commands already running finish (or hit the deadline); no new ones start.
+  ~BatchRun() {
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      cancelled_ = true;
+    }
+    for (auto &t : threads_) t.join();
+  }
+
+  // Waits for the next result; returns false once every result was handed out.
+  bool next(size_t &index, ExecResult &result) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (handed_out_ == commands_.size()) return false;
+    if (ordered_) {
+      cond_.wait(lock, [&] { return ready_[handed_out_]; });
+      index = handed_out_;
+    } else {
+      cond_.wait(lock, [&] { return !finished_.empty(); });
+      index = finished_.front();
+      finished_.pop();
+    }
+    ++handed_out_;
+    result = std::move(results_[index]);
+    return true;
+  }
+
+  const std::string &command(size_t index) const { return commands_[index]; }
+  size_t skipped() const { return skipped_; }
+
+private:
+  void worker() {
+    while (true) {
+      size_t index;
+      {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (cancelled_ || next_claim_ == commands_.size()) return;
+        index = next_claim_++;
+      }
+
+      const bool skip = std::chrono::steady_clock::now() >= opts_.deadline;
+      std::unique_ptr<AdmissionControl::Ticket> ticket;
+      ExecResult r;
+      if (skip) {
+        r = {false, -1, true, "", "skipped: batch deadline exceeded"};
+      } else if (g_admission &&
+                 g_admission->admit(ticket) != AdmissionControl::Outcome::Admitted) {
+        r = {false, -1, false, "", "overloaded: no command slot within the queue deadline"};
+      } else {
+        r = run_command(commands_[index], opts_);
+        ticket.reset();
+      }
+
+      {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (skip) ++skipped_;
+        results_[index] = std::move(r);
+        ready_[index] = true;
+        finished_.push(index);
+      }
+      cond_.notify_one();
+    }
+  }
+
+  std::vector<std::string> commands_;
+  bool ordered_;
+  RunOptions opts_;
+  std::vector<ExecResult> results_;
+  std::vector<bool> ready_;
+  std::queue<size_t> finished_;
+  size_t next_claim_ = 0;
+  size_t handed_out_ = 0;
+  size_t skipped_ = 0;
+  bool cancelled_ = false;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
+int main() {
+  load_config_from_env();
+  std::vector<int> listen_fds = systemd_listen_fds();
+
+  {
+    std::string error;
+    if (!reload_keyring(error)) {
+      std::cerr << "failed to load keyring: " << error << "\n";
+      return 1;
+    }
+    start_signal_thread(!env_or("CMD_SERVICE_KEYRING", "").empty());
+  }
+
+  add_builtin_rules(g_filter);
+  const std::string rules_path = env_or("CMD_SERVICE_FILTER_RULES", "");
+  if (!rules_path.empty()) {
+    std::string error;
+    if (!load_filter_rules(g_filter, rules_path, error)) {
+      std::cerr << "failed to load filter rules: " << error << "\n";
+      return 1;
+    }
+  }
+  g_filter.compile();
+
+  if (!g_config.cgroup_root.empty()) {
+    std::string error;
+    if (!prepare_cgroup_root(error)) {
+      std::cerr << "CMD_SERVICE_CGROUP_ROOT: " << error << "\n";
+      return 1;
+    }
+  }
+
+  if (g_config.shell_mode == ShellMode::Snapshot) {
+    // The snapshot itself comes from a login shell; later commands use -c.
+    g_config.shell_mode = ShellMode::Login;
+    std::string error;
+    if (!take_env_snapshot(error)) {
+      std::cerr << "environment snapshot failed (" << error << "), using plain shell mode\n";
+    }
+    g_config.shell_mode = ShellMode::Snapshot;
+  }
+
+  if (!g_config.access_log.empty()) {
+    std::string error;
+    g_access_log = AccessLog::open(g_config.access_log, g_config.access_log_buffer,
+                                   g_config.access_log_max_bytes, g_config.access_log_keep,
+                                   error);
+    if (!g_access_log) {
+      std::cerr << "CMD_SERVICE_ACCESS_LOG: " << error << "\n";
+      return 1;
+    }
+  }
+
+  if (g_config.max_children > 0) {
+    g_admission.reset(new AdmissionControl(
+        g_config.max_children, g_config.admission_queue,
+        std::chrono::milliseconds(g_config.admission_queue_ms), g_config.admission_adaptive));
+  }
+
+  if (g_config.shell_workers > 0) {
+    g_shell_workers.reset(
+        new ShellWorkerPool(g_config.shell_workers, g_config.shell_workers_max,
+                            std::chrono::seconds(g_config.shell_worker_idle_sec)));
+    std::string error;
+    if (!g_shell_workers->prestart(error)) {
+      std::cerr << "shell workers failed to start (" << error << "), spawning per command\n";
+      g_shell_workers.reset();
+    }
+  }
+
+  ResultCache cache(g_config.cache_bytes);
+  const std::string cache_rules_path = env_or("CMD_SERVICE_CACHE_RULES", "");
+  if (!cache_rules_path.empty()) {
+    std::string error;
+    if (!load_cache_rules(cache, cache_rules_path, error)) {
+      std::cerr << "failed to load cache rules: " << error << "\n";
+      return 1;
+    }
+  }
+
+  httplib::Server svr;
+  svr.set_keep_alive_reactor(g_config.keep_alive_reactor);
+  svr.set_listener_count(g_config.listeners);
+  // Buffered responses are compressed by httplib when the client asks and
+  // the build has a codec (-DCPPHTTPLIB_ZLIB_SUPPORT -lz, and so on).
+  svr.set_compression_threshold(g_config.compression_min_bytes);
+  svr.set_compression_level(g_config.compression_level);
+  svr.set_listen_backlog(g_config.listen_backlog);
+
+  // Called once per listener; the worker threads are split between them.
+  svr.new_task_queue = []() -> httplib::TaskQueue * {
+    size_t threads = g_config.http_threads ? g_config.http_threads
+                                           : CPPHTTPLIB_THREAD_POOL_COUNT;
+    threads = std::max<size_t>(1, threads / g_config.listeners);
+    if (g_config.work_stealing_pool) {
+      return new TrackedPool<httplib::WorkStealingThreadPool>(threads, size_t(1024),
+                                                              g_config.pin_http_threads);
+    }
+    return new TrackedPool<httplib::ThreadPool>(threads, threads * 4);
+  };
+
+  // The same worker thread runs pre-routing, the handler and post-routing
+  // for a request, so they share its access record; handlers add the command
+  // and its result. The pre-routing handler is installed below, once
+  // authorize exists. Requests that fail to parse skip pre-routing.
+  //
+  // Post-routing sees the same final response as set_logger would, just
+  // before the headers go out, but not under httplib's logger mutex, which
+  // would serialize every worker on it.
+  static thread_local AccessRecord request_access;
+  svr.set_post_routing_handler([](const httplib::Request &req, httplib::Response &res) {
+    if (!request_access.begun) request_access.begin(req.method, req.path);
+    g_metrics.request_seconds.observe(ScopedTimer::seconds_since(request_access.started));
+    if (res.status >= 100 && res.status < 600) {
+      g_metrics.responses[res.status / 100].fetch_add(1, std::memory_order_relaxed);
+    }
+    if (g_access_log && !request_access.deferred) {
+      request_access.finish(res.status, res.body.size());
+      g_access_log->push(request_access);
+    }
+    request_access.begun = false;
+  });
+
+  svr.Get("/metrics", [](const httplib::Request &, httplib::Response &res) {
+    std::string out;
+    for (const Histogram *h :
+         {&g_metrics.request_seconds, &g_metrics.auth_seconds, &g_metrics.filter_seconds,
+          &g_metrics.spawn_seconds, &g_metrics.child_seconds, &g_metrics.render_seconds,
+          &g_metrics.output_bytes}) {
+      h->render(out);
+    }
+
+    out += "# HELP cmd_service_http_responses_total HTTP responses by status class.\n"
+           "# TYPE cmd_service_http_responses_total counter\n";
+    for (int i = 1; i <= 5; ++i) {
+      out += "cmd_service_http_responses_total{code=\"" + std::to_string(i) + "xx\"} " +
+             std::to_string(g_metrics.responses[i].load()) + "\n";
+    }
+    out += "# HELP cmd_service_commands_total Commands run, by outcome.\n"
+           "# TYPE cmd_service_commands_total counter\n"
+           "cmd_service_commands_total{result=\"ok\"} " +
+           std::to_string(g_metrics.commands_ok.load()) +
+           "\ncmd_service_commands_total{result=\"timed_out\"} " +
+           std::to_string(g_metrics.commands_timed_out.load()) +
+           "\ncmd_service_commands_total{result=\"failed\"} " +
+           std::to_string(g_metrics.commands_failed.load()) + "\n";
+    out += "# HELP cmd_service_auth_rejected_total Requests refused by authorize.\n"
+           "# TYPE cmd_service_auth_rejected_total counter\n"
+           "cmd_service_auth_rejected_total{reason=\"unauthorized\"} " +
+           std::to_string(g_metrics.auth_unauthorized.load()) +
+           "\ncmd_service_auth_rejected_total{reason=\"rate_limited\"} " +
+           std::to_string(g_metrics.auth_rate_limited.load()) + "\n";
+
+    if (g_admission) {
+      AdmissionControl::Stats adm = g_admission->stats();
+      out += "# HELP cmd_service_admission_limit Commands allowed to run at once.\n"
+             "# TYPE cmd_service_admission_limit gauge\n"
+             "cmd_service_admission_limit " + std::to_string(adm.limit) +
+             "\n# HELP cmd_service_admission_in_flight Commands holding a slot.\n"
+             "# TYPE cmd_service_admission_in_flight gauge\n"
+             "cmd_service_admission_in_flight " + std::to_string(adm.in_flight) +
+             "\n# HELP cmd_service_admission_waiting Requests queued for a slot.\n"
+             "# TYPE cmd_service_admission_waiting gauge\n"
+             "cmd_service_admission_waiting " + std::to_string(adm.waiting) +
+             "\n# HELP cmd_service_admission_rejected_total Requests turned away with 503.\n"
+             "# TYPE cmd_service_admission_rejected_total counter\n"
+             "cmd_service_admission_rejected_total{reason=\"queue_full\"} " +
+             std::to_string(adm.rejected_full) +
+             "\ncmd_service_admission_rejected_total{reason=\"queue_timeout\"} " +
+             std::to_string(adm.rejected_timeout) + "\n";
+    }
+    if (g_access_log) {
+      out += "# HELP cmd_service_access_log_records_total Access log records, by outcome.\n"
+             "# TYPE cmd_service_access_log_records_total counter\n"
+             "cmd_service_access_log_records_total{result=\"written\"} " +
+             std::to_string(g_access_log->written()) +
+             "\ncmd_service_access_log_records_total{result=\"dropped\"} " +
+             std::to_string(g_access_log->dropped()) + "\n";
+    }
+    {
+      PoolStats pool = http_pool_stats();
+      out += "# HELP cmd_service_http_pool_queued Connections waiting for an HTTP worker.\n"
+             "# TYPE cmd_service_http_pool_queued gauge\n"
+             "cmd_service_http_pool_queued " + std::to_string(pool.queued) +
+             "\n# HELP cmd_service_http_pool_idle Idle HTTP worker threads.\n"
+             "# TYPE cmd_service_http_pool_idle gauge\n"
+             "cmd_service_http_pool_idle " + std::to_string(pool.idle) +
+             "\n# HELP cmd_service_http_pool_threads HTTP worker threads.\n"
+             "# TYPE cmd_service_http_pool_threads gauge\n"
+             "cmd_service_http_pool_threads " + std::to_string(pool.threads) + "\n";
+    }
+    res.set_content(out, "text/plain; version=0.0.4");
+  });
+
+  svr.Get("/health", [](const httplib::Request &, httplib::Response &res) {
+    if (g_draining) {
+      res.status = 503;
+      res.set_content("{\"ok\":false,\"draining\":true}", "application/json");
+      return;
+    }
+    res.set_content("{\"ok\":true}", "application/json");
+  });
+
+  svr.Get("/tasks", [](const httplib::Request &, httplib::Response &res) {
+    res.set_content(
+        "{\"mode\":\"direct_command\",\"usage\":\"POST /run with raw command body\","
+        "\"stream\":\"POST /run?stream=1 for server-sent events, ?stream=raw for raw "
+        "output with the exit code in trailers\","
+        "\"raw\":\"POST /run with Accept: application/octet-stream for the output as the "
+        "body and the exit code in X-Exit-Code\","
+        "\"batch\":\"POST /run/batch with a JSON array of commands for NDJSON results, "
+        "?parallel=N&order=completion&deadline=S\","
+        "\"jobs\":\"POST /jobs?priority=N, then GET /jobs/<id>?wait=S\","
+        "\"auth\":\"Authorization: Bearer <token>\"}",
+                    "application/json");
+  });
+
+  auto authorize = [](const httplib::Request &req, httplib::Response &res) -> bool {
+    ScopedTimer timer(g_metrics.auth_seconds);
+    auto it = req.headers.find("Authorization");
+    const Keyring::Key *key = it == req.headers.end()
+                                  ? nullptr
+                                  : g_keyring.load(std::memory_order_acquire)
+                                        ->verify(parse_authorization(it->second));
+    if (!key) {
+      g_metrics.auth_unauthorized.fetch_add(1, std::memory_order_relaxed);
+      res.status = 401;
+      res.set_content(
+          "{\"error\":\"unauthorized: expected Authorization header (Bearer <token>)\"}",
+          "application/json");
+      return false;
+    }
+    if (int64_t wait_ns = key->limiter ? key->limiter->acquire() : 0) {
+      g_metrics.auth_rate_limited.fetch_add(1, std::memory_order_relaxed);
+      res.status = 429;
+      res.set_header("Retry-After", std::to_string(wait_ns / 1000000000 + 1));
+      res.set_content("{\"error\":\"rate limit exceeded for key '" + json_escape(key->name) +
+                          "'\"}",
+                      "application/json");
+      return false;
+    }
+    return true;
+  };
+
+  // Mounted files go out through the sendfile path; they need the same
+  // token as everything else.
+  if (!g_config.static_dir.empty() &&
+      !svr.set_mount_point(g_config.static_mount, g_config.static_dir)) {
+    std::cerr << "CMD_SERVICE_STATIC_DIR '" << g_config.static_dir << "' is not a directory\n";
+    return 1;
+  }
+  svr.set_pre_routing_handler([authorize](const httplib::Request &req, httplib::Response &res) {
+    request_access.begin(req.method, req.path);
+    if (!g_config.static_dir.empty() && req.path.rfind(g_config.static_mount, 0) == 0 &&
+        !authorize(req, res)) {
+      return httplib::Server::HandlerResponse::Handled;
+    }
+    return httplib::Server::HandlerResponse::Unhandled;
+  });
+
+  auto render_result = [](const std::string &command, const ExecResult &r, httplib::Response &res) {
+    ScopedTimer timer(g_metrics.render_seconds);
+    if (!r.ok) {
+      if (r.error.rfind("overloaded:", 0) == 0) {
+        res.status = 503;
+        if (g_admission) {
+          res.set_header("Retry-After", std::to_string(g_admission->retry_after()));
+        }
+      } else {
+        res.status = (r.error.rfind("blocked command:", 0) == 0) ? 403 : 400;
+      }
+      res.set_content("{\"error\":\"" + json_escape(r.error) + "\"}", "application/json");
+      return;
+    }
+
+    // Build in the response's own (possibly recycled) buffer, sized once.
+    std::string body;
+    body.swap(res.body);
+    body.clear();
+    body.reserve(JsonWriter::field_size("command") +
+                 json_escaped_size(command.data(), command.size()) + result_fields_size(r));
+    JsonWriter w(body);
+    w.str("command", command);
+    write_result_fields(w, r);
+    w.close();
+    res.set_content(std::move(body), "application/json");
+  };
+
+  // Accept: application/octet-stream on a buffered /run: the output is the
+  // body byte for byte, with no escaping, and the rest of the result goes in
+  // headers. Errors are still JSON, told apart by their 4xx status. httplib
+  // leaves octet-stream bodies alone, so the negotiated codec is applied
+  // here, above the same threshold; not to range requests, whose ranges
+  // httplib cuts from the body afterwards.
+  auto render_raw = [render_result](const httplib::Request &req, const std::string &command,
+                                    ExecResult &r, std::chrono::steady_clock::time_point started,
+                                    httplib::Response &res) {
+    if (!r.ok) {
+      render_result(command, r, res);
+      return;
+    }
+    ScopedTimer timer(g_metrics.render_seconds);
+    char duration[32];
+    std::snprintf(duration, sizeof(duration), "%.3f",
+                  ScopedTimer::seconds_since(started) * 1000);
+    res.set_header("X-Exit-Code", std::to_string(r.exit_code));
+    res.set_header("X-Timed-Out", r.timed_out ? "true" : "false");
+    res.set_header("X-Truncated", r.truncated ? "true" : "false");
+    res.set_header("X-Output-Bytes", std::to_string(r.output_bytes));
+    res.set_header("X-Duration-Ms", duration);
+    // Only stdout fits in the body; stderr is reported by size (JSON has it).
+    if (r.split_stderr) {
+      res.set_header("X-Stderr-Bytes", std::to_string(r.stderr_bytes));
+    }
+    if (r.usage.measured) {
+      res.set_header("X-Cpu-Usec", std::to_string(r.usage.cpu_usec));
+      res.set_header("X-User-Usec", std::to_string(r.usage.user_usec));
+      res.set_header("X-System-Usec", std::to_string(r.usage.system_usec));
+      res.set_header("X-Memory-Peak-Bytes", std::to_string(r.usage.memory_peak_bytes));
+      res.set_header("X-Io-Read-Bytes", std::to_string(r.usage.io_read_bytes));
+      res.set_header("X-Io-Write-Bytes", std::to_string(r.usage.io_write_bytes));
+    }
+    std::string encoding;
+    std::unique_ptr<httplib::detail::compressor> compressor;
+    if (r.output.size() >= g_config.compression_min_bytes && !req.has_header("Range")) {
+      compressor = negotiate_compressor(req, encoding);
+    }
+    std::string compressed;
+    if (compressor && compressor->compress(r.output.data(), r.output.size(), true,
+                                           [&](const char *data, size_t len) {
+                                             compressed.append(data, len);
+                                             return true;
+                                           })) {
+      r.output.swap(compressed);
+      res.set_header("Content-Encoding", encoding);
+      res.set_header("Vary", "Accept-Encoding");
+    }
+    res.set_content(std::move(r.output), "application/octet-stream");
+  };
+
+  // Server-sent events: "output" events carry {"data":...} chunks as they are
+  // read, and a final "exit" (or "error") event carries the result.
+  // The admission ticket (if any) is held by the content provider, so the
+  // slot stays taken until the stream ends.
+  using TicketPtr = std::shared_ptr<AdmissionControl::Ticket>;
+  // With split stderr, stderr chunks arrive as "stderr" events instead.
+  auto stream_result = [render_result](const std::string &command, RunOptions opts,
+                                       TicketPtr ticket, httplib::Response &res) {
+    std::string error;
+    if (!check_command(command, error)) {
+      render_result(command, {false, -1, false, "", error}, res);
+      return;
+    }
+
+    request_access.deferred = true;
+    res.set_header("Cache-Control", "no-cache");
+    res.set_chunked_content_provider(
+        "text/event-stream",
+        [command, opts, ticket, access = request_access](size_t, httplib::DataSink &sink) {
+          StreamAccess log(access);
+          // One buffer is reused for every event of the stream.
+          std::string msg;
+          auto send_event = [&sink, &msg, &log](const char *event,
+                                                const std::function<void(JsonWriter &)> &fill) {
+            msg.clear();
+            msg += "event: ";
+            msg += event;
+            msg += "\ndata: ";
+            JsonWriter w(msg);
+            fill(w);
+            w.close();
+            msg += "\n\n";
+            log.bytes_out += msg.size();
+            return sink.write(msg.data(), msg.size());
+          };
+
+          auto forward = [&](const char *event) {
+            return [&, event](const char *data, size_t len) {
+              if (!sink.is_writable()) return false;
+              msg.reserve(32 + json_escaped_size(data, len));
+              return send_event(event, [&](JsonWriter &w) { w.str("data", data, len); });
+            };
+          };
+          RunOptions run_opts = opts;
+          if (run_opts.split_stderr) run_opts.on_stderr = forward("stderr");
+          ExecResult r = run_command(command, run_opts, forward("output"));
+          log.record.set_result(r);
+
+          if (r.ok) {
+            send_event("exit", [&](JsonWriter &w) {
+              w.num("exit_code", r.exit_code).boolean("timed_out", r.timed_out);
+            });
+          } else {
+            send_event("error", [&](JsonWriter &w) { w.str("error", r.error); });
+          }
+          sink.done();
+          return true;
+        });
+  };
+
+  // ?stream=raw: the output itself as a chunked octet stream, with the exit
+  // status in trailers. On plain sockets the pipe is spliced to the client
+  // without passing through user space; if the client accepts a codec the
+  // output is compressed chunk by chunk instead.
+  auto stream_raw = [render_result](const httplib::Request &req, const std::string &command,
+                                    TicketPtr ticket, httplib::Response &res) {
+    std::string error;
+    if (!check_command(command, error)) {
+      render_result(command, {false, -1, false, "", error}, res);
+      return;
+    }
+
+    std::string encoding;
+    std::shared_ptr<httplib::detail::compressor> compressor = negotiate_compressor(req, encoding);
+    if (compressor) {
+      res.set_header("Content-Encoding", encoding);
+      res.set_header("Vary", "Accept-Encoding");
+    }
+    res.set_header("Cache-Control", "no-cache");
+    res.set_header("Trailer", "X-Exit-Code, X-Timed-Out");
+    request_access.deferred = true;
+    res.set_chunked_content_provider(
+        "application/octet-stream",
+        [command, compressor, ticket, access = request_access](size_t, httplib::DataSink &sink) {
+          StreamAccess log(access);
+          auto forward = [&sink, &log](const char *data, size_t len) {
+            log.bytes_out += len;
+            return sink.write(data, len);
+          };
+          RunOptions opts;
+          if (sink.write_pipe && !compressor) {
+            opts.on_pipe = [&sink, &log](int fd, size_t available) {
+              log.bytes_out += available;
+              return sink.write_pipe(fd, available);
+            };
+          }
+          ExecResult r = run_command(command, opts, [&](const char *data, size_t len) {
+            if (!sink.is_writable()) return false;
+            return compressor ? compressor->compress(data, len, false, forward)
+                              : forward(data, len);
+          });
+          if (compressor) compressor->compress(nullptr, 0, true, forward);
+          log.record.set_result(r);
+
+          httplib::Headers trailer;
+          trailer.emplace("X-Exit-Code", std::to_string(r.ok ? r.exit_code : -1));
+          trailer.emplace("X-Timed-Out", r.timed_out ? "true" : "false");
+          sink.done_with_trailer(trailer);
+          return true;
+        });
+  };
+
+  auto extract_command = [](const httplib::Request &req, httplib::Response &res,
+                            std::string &command) -> bool {
+    command = trim_copy(req.body);
+    command = trim_copy(decode_json_string_like(command));
+    if (command.empty()) {
+      res.status = 400;
+      res.set_content("{\"error\":\"missing command: send command in request body\"}",
+                      "application/json");
+      return false;
+    }
+    return true;
+  };
+
+  auto int_param = [](const httplib::Request &req, const char *key, int fallback, int lo,
+                      int hi) -> int {
+    if (!req.has_param(key)) return fallback;
+    try {
+      return std::min(hi, std::max(lo, std::stoi(req.get_param_value(key))));
+    } catch (const std::exception &) {
+      return fallback;
+    }
+  };
+
+  // ?max_output=BYTES lowers the output cap for one request; the server-wide
+  // CMD_SERVICE_OUTPUT_CAP is the ceiling. ?stderr=separate (or combined)
+  // overrides CMD_SERVICE_STDERR, and ?max_stderr=BYTES lowers
+  // CMD_SERVICE_STDERR_CAP.
+  auto run_options = [](const httplib::Request &req) -> RunOptions {
+    RunOptions opts;
+    if (req.has_param("max_output")) {
+      opts.output_cap = static_cast<size_t>(
+          std::strtoull(req.get_param_value("max_output").c_str(), nullptr, 10));
+    }
+    const std::string mode = req.get_param_value("stderr");
+    opts.split_stderr = mode.empty() ? g_config.split_stderr : mode == "separate";
+    if (req.has_param("max_stderr")) {
+      opts.stderr_cap = static_cast<size_t>(
+          std::strtoull(req.get_param_value("max_stderr").c_str(), nullptr, 10));
+    }
+    return opts;
+  };
+
+  // Takes a command slot, or answers 503 with Retry-After when there is none
+  // to be had within CMD_SERVICE_ADMISSION_QUEUE_MS.
+  auto admit = [](httplib::Response &res, TicketPtr &ticket) -> bool {
+    if (!g_admission) return true;
+    std::unique_ptr<AdmissionControl::Ticket> admitted;
+    AdmissionControl::Outcome outcome = g_admission->admit(admitted);
+    if (outcome == AdmissionControl::Outcome::Admitted) {
+      ticket = std::move(admitted);
+      return true;
+    }
+    res.status = 503;
+    res.set_header("Retry-After", std::to_string(g_admission->retry_after()));
+    res.set_content(outcome == AdmissionControl::Outcome::QueueFull
+                        ? "{\"error\":\"overloaded: admission queue full\"}"
+                        : "{\"error\":\"overloaded: no command slot within the queue deadline\"}",
+                    "application/json");
+    return false;
+  };
+
+  svr.Post("/run", [&cache, authorize, extract_command, render_result, render_raw, stream_result,
+                    stream_raw, run_options, admit](const httplib::Request &req,
+                                                    httplib::Response &res) {
+    if (!authorize(req, res)) return;
+
+    std::string command;
+    if (!extract_command(req, res, command)) return;
+    request_access.set_command(command);
+
+    const std::string stream = req.get_param_value("stream");
+    if (stream == "raw" || stream == "1") {
+      TicketPtr ticket;
+      if (!admit(res, ticket)) return;
+      if (stream == "raw") {
+        stream_raw(req, command, std::move(ticket), res);
+      } else {
+        stream_result(command, run_options(req), std::move(ticket), res);
+      }
+      return;
+    }
+
+    const bool raw = req.get_header_value("Accept").find("application/octet-stream") !=
+                     std::string::npos;
+    const auto started = std::chrono::steady_clock::now();
+    // Only the request that starts a child takes a slot: cache hits and
+    // coalesced waiters don't. Waiters on a leader that was turned away get
+    // its overloaded error, which render_result answers with 503 as well.
+    bool rejected = false;
+    auto run = [&]() -> ExecResult {
+      TicketPtr ticket;
+      if (!admit(res, ticket)) {
+        rejected = true;
+        return {false, -1, false, "", "overloaded: no command slot within the queue deadline"};
+      }
+      return run_command(command, run_options(req));
+    };
+    ExecResult r;
+    // Cached results all come from the server's default options.
+    if (cache.enabled() && cache.cacheable(command) && !req.has_param("max_output") &&
+        !req.has_param("stderr") && !req.has_param("max_stderr")) {
+      ResultCache::Outcome outcome;
+      r = cache.get_or_run(command, run, outcome);
+      if (rejected) return;  // admit has answered 503
+      res.set_header("X-Cache", outcome == ResultCache::Outcome::Hit         ? "hit"
+                                : outcome == ResultCache::Outcome::Coalesced ? "coalesced"
+                                                                            : "miss");
+    } else {
+      r = run();
+      if (rejected) return;
+    }
+    request_access.set_result(r);
+
+    if (raw) {
+      render_raw(req, command, r, started, res);
+    } else {
+      render_result(command, r, res);
+    }
+  });
+
+  // POST /run/batch takes a JSON array of commands (or one command per line)
+  // and streams one NDJSON result line per command as each is ready, then a
+  // summary line. ?parallel=N bounds how many run at once, ?order=completion
+  // emits results as they finish instead of in input order, ?timeout=S bounds
+  // each command and ?deadline=S the whole batch.
+  svr.Post("/run/batch", [authorize, int_param, run_options](const httplib::Request &req,
+                                                             httplib::Response &res) {
+    if (!authorize(req, res)) return;
+
+    auto commands = std::make_shared<std::vector<std::string>>();
+    const std::string body = trim_copy(req.body);
+    if (!body.empty() && body.front() == '[') {
+      std::string error;
+      if (!parse_json_string_array(body, *commands, error)) {
+        res.status = 400;
+        res.set_content("{\"error\":\"" + json_escape(error) + "\"}", "application/json");
+        return;
+      }
+    } else {
+      for (const std::string &line : split_fields(body, '\n')) {
+        std::string command = trim_copy(decode_json_string_like(trim_copy(line)));
+        if (!command.empty()) commands->push_back(std::move(command));
+      }
+    }
+    if (commands->empty()) {
+      res.status = 400;
+      res.set_content("{\"error\":\"missing commands: send a JSON array of commands\"}",
+                      "application/json");
+      return;
+    }
+    if (commands->size() > g_config.batch_max_commands) {
+      res.status = 413;
+      res.set_content("{\"error\":\"too many commands: the limit is " +
+                          std::to_string(g_config.batch_max_commands) + "\"}",
+                      "application/json");
+      return;
+    }
+
+    const auto started = std::chrono::steady_clock::now();
+    RunOptions opts = run_options(req);
+    opts.timeout_sec = int_param(req, "timeout", 20, 1, 3600);
+    opts.deadline = started + std::chrono::seconds(int_param(req, "deadline", 60, 1, 3600));
+    const size_t parallel = static_cast<size_t>(
+        int_param(req, "parallel", static_cast<int>(g_config.batch_parallel), 1,
+                  static_cast<int>(g_config.batch_parallel)));
+    const bool ordered = req.get_param_value("order") != "completion";
+
+    // httplib doesn't compress application/x-ndjson, so lines go through a
+    // negotiated codec here, as ?stream=raw does. The codec buffers, so a
+    // compressed line may reach the client later than it is written.
+    std::string encoding;
+    std::shared_ptr<httplib::detail::compressor> compressor = negotiate_compressor(req, encoding);
+    if (compressor) {
+      res.set_header("Content-Encoding", encoding);
+      res.set_header("Vary", "Accept-Encoding");
+    }
+    res.set_header("Cache-Control", "no-cache");
+    request_access.deferred = true;
+    res.set_chunked_content_provider(
+        "application/x-ndjson",
+        [commands, parallel, ordered, opts, started, compressor,
+         access = request_access](size_t, httplib::DataSink &sink) {
+          StreamAccess log(access);
+          auto forward = [&sink, &log](const char *data, size_t len) {
+            log.bytes_out += len;
+            return sink.write(data, len);
+          };
+          auto emit = [&](const std::string &s) {
+            return compressor ? compressor->compress(s.data(), s.size(), false, forward)
+                              : forward(s.data(), s.size());
+          };
+          const size_t count = commands->size();
+          BatchRun batch(std::move(*commands), parallel, ordered, opts);
+
+          // One buffer is reused for every line.
+          std::string line;
+          size_t index;
+          ExecResult r;
+          while (batch.next(index, r)) {
+            const std::string &command = batch.command(index);
+            line.clear();
+            line.reserve(32 + JsonWriter::field_size("command") +
+                         json_escaped_size(command.data(), command.size()) +
+                         result_fields_size(r) + r.error.size() * 6);
+            JsonWriter w(line);
+            w.num("index", static_cast<long long>(index)).str("command", command);
+            if (r.ok) {
+              write_result_fields(w, r);
+            } else {
+              w.str("error", r.error);
+            }
+            w.close();
+            line += '\n';
+            if (!emit(line)) return false;
+          }
+
+          line.clear();
+          JsonWriter w(line);
+          w.boolean("done", true)
+              .num("count", static_cast<long long>(count))
+              .num("skipped", static_cast<long long>(batch.skipped()))
+              .num("elapsed_ms",
+                   std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::steady_clock::now() - started)
+                       .count());
+          w.close();
+          line += '\n';
+          emit(line);
+          if (compressor) compressor->compress(nullptr, 0, true, forward);
+          sink.done();
+          return true;
+        });
+  });
+
+  JobScheduler jobs(g_config.job_workers, g_config.job_queue_max);
+
+
+  // POST /jobs?priority=N&timeout=S queues the command and returns its id.
+  svr.Post("/jobs", [&jobs, authorize, extract_command, render_result, int_param, run_options](
+                        const httplib::Request &req, httplib::Response &res) {
+    if (!authorize(req, res)) return;
+
+    std::string command;
+    if (!extract_command(req, res, command)) return;
+    request_access.set_command(command);
+
+    std::string error;
+    if (!check_command(command, error)) {
+      render_result(command, {false, -1, false, "", error}, res);
+      return;
+    }
+
+    RunOptions opts = run_options(req);
+    opts.timeout_sec = int_param(req, "timeout", 20, 1, 3600);
+    std::string id = jobs.submit(command, int_param(req, "priority", 0, -1000, 1000), opts);
+    if (id.empty()) {
+      res.status = 503;
+      res.set_content("{\"error\":\"job queue full\"}", "application/json");
+      return;
+    }
+    res.status = 202;
+    res.set_header("Location", "/jobs/" + id);
+    res.set_content("{\"id\":\"" + id + "\",\"state\":\"queued\"}", "application/json");
+  });
+
+  // GET /jobs/:id?wait=S long-polls up to S seconds for the job to finish.
+  svr.Get("/jobs/:id", [&jobs, authorize, int_param](const httplib::Request &req,
+                                                     httplib::Response &res) {
+    if (!authorize(req, res)) return;
+
+    JobScheduler::Job job;
+    std::chrono::milliseconds wait(int_param(req, "wait", 0, 0, 60) * 1000);
+    if (!jobs.get(req.path_params.at("id"), wait, job)) {
+      res.status = 404;
+      res.set_content("{\"error\":\"unknown job id\"}", "application/json");
+      return;
+    }
+
+    const ExecResult &r = job.result;
+    const bool done = job.state == JobScheduler::State::Done;
+    std::string body;
+    body.reserve(64 + json_escaped_size(job.command.data(), job.command.size()) +
+                 (done ? result_fields_size(r) + r.error.size() * 6 : 0));
+    JsonWriter w(body);
+    w.str("id", job.id)
+        .str("state", JobScheduler::state_name(job.state))
+        .str("command", job.command);
+    if (done) {
+      if (!r.ok) {
+        w.str("error", r.error);
+      } else {
+        write_result_fields(w, r);
+      }
+    }
+    w.close();
+    res.set_content(std::move(body), "application/json");
+  });
+
+  // Sockets from systemd or from the process serving now, else our own.
+  int handoff_conn = -1;
+  if (listen_fds.empty() && !g_config.handoff_socket.empty()) {
+    handoff_conn = request_handoff(g_config.handoff_socket, listen_fds);
+  }
+  if (!listen_fds.empty() && svr.adopt_listen_sockets(listen_fds)) {
+    std::cout << "Serving " << listen_fds.size() << " inherited listening sockets\n";
+  } else if (!listen_fds.empty()) {
+    std::cerr << "failed to adopt the inherited listening sockets\n";
+    return 1;
+  } else if (svr.bind_to_port("0.0.0.0", 8081)) {
+    std::cout << "Listening on 0.0.0.0:8081\n";
+  } else {
+    std::cerr << "failed to listen on 0.0.0.0:8081\n";
+    return 1;
+  }
+  // Draining closes the listening sockets under the accept loops, which only
+  // notice when accept() doesn't block and they wake up on their own.
+  for (int fd : svr.listen_sockets()) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  svr.set_idle_interval(0, 100000);
+
+  g_server.store(&svr);
+  if (g_draining) svr.release_listen_sockets();  // signalled before g_server was set
+  if (!g_config.handoff_socket.empty()) {
+    std::string error;
+    if (!start_handoff_listener(g_config.handoff_socket, error)) {
+      std::cerr << "CMD_SERVICE_HANDOFF_SOCKET: " << error << ", hot restart disabled\n";
+    }
+  }
+  if (handoff_conn >= 0) {
+    char ack = 0;
+    ssize_t n = write(handoff_conn, &ack, 1);
+    (void)n;
+    close(handoff_conn);
+  }
 
-  std::cout << "Listening on 0.0.0.0:8081\n";
-  svr.listen("0.0.0.0", 8081);
+  // Returns once draining has let the last request finish. Jobs already
+  // running finish in ~JobScheduler; queued ones are dropped.
+  return svr.listen_after_bind() ? 0 : 1;
 }